@@ -157,12 +157,14 @@ int getkey() {
 			break;
 
 		default:
+			if (ch >= 0x20 && ch < 0x7F)
+				return alt(ch);
 			return KEY_UNKNOWN;
 		}
 		break;
 
 	case 0x00:
-	case 0xE0:
+		// Not 0xE0, the other DOS prefix: it is also a UTF-8 lead byte
 		ch = getchar_logged();
 		switch (ch) {
 		case 0x0F:
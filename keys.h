@@ -48,9 +48,12 @@
 #define KEY_F6               0x126
 #define KEY_F7               0x128
 
+#define KEY_ALT              0x200
+
 #define KEY_UNKNOWN          0xFFF
 
 #define ctrl(c) ((c) - 0x60)
+#define alt(c) (KEY_ALT + (c))
 
 #define LAST_KEYS_LENGTH     6
 
@@ -62,4 +65,6 @@ unsigned char last_keys[LAST_KEYS_LENGTH];
 
 void initkeys();
 
+int getchar_logged();
+
 int getkey();
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "syntax.h"
+
+//
+// Lexer states
+//
+// The state at the end of a line is all that carries over to the next
+// one: the low byte holds the mode and strings keep their quote above it.
+//
+
+#define MODE_NORMAL          0
+#define MODE_COMMENT         1
+#define MODE_STRING          2
+#define MODE_PREPROC         3
+
+//
+// Languages
+//
+
+char *c_keywords[] = {
+	"auto", "break", "case", "catch", "class", "const", "constexpr",
+	"continue", "default", "delete", "do", "else", "enum", "explicit",
+	"extern", "false", "for", "friend", "goto", "if", "inline", "namespace",
+	"new", "noexcept", "nullptr", "operator", "override", "private",
+	"protected", "public", "register", "restrict", "return", "sizeof",
+	"static", "struct", "switch", "template", "this", "throw", "true", "try",
+	"typedef", "typename", "union", "using", "virtual", "volatile", "while",
+	NULL
+};
+
+char *c_types[] = {
+	"bool", "char", "double", "float", "int", "int16_t", "int32_t",
+	"int64_t", "int8_t", "long", "off_t", "short", "signed", "size_t",
+	"ssize_t", "uint16_t", "uint32_t", "uint64_t", "uint8_t", "unsigned",
+	"void", "wchar_t",
+	NULL
+};
+
+char *sh_keywords[] = {
+	"case", "do", "done", "elif", "else", "esac", "exit", "export", "fi",
+	"for", "function", "if", "in", "local", "readonly", "return", "select",
+	"shift", "then", "until", "while",
+	NULL
+};
+
+char *json_keywords[] = {
+	"false", "null", "true",
+	NULL
+};
+
+char *yaml_keywords[] = {
+	"False", "No", "Null", "Off", "On", "True", "Yes", "false", "no", "null",
+	"off", "on", "true", "yes",
+	NULL
+};
+
+char *log_keywords[] = {
+	"DEBUG", "INFO", "NOTICE", "TRACE",
+	NULL
+};
+
+char *log_errors[] = {
+	"ALERT", "CRIT", "CRITICAL", "EMERG", "ERR", "ERROR", "FATAL", "PANIC",
+	"SEVERE",
+	NULL
+};
+
+char *log_warnings[] = {
+	"WARN", "WARNING",
+	NULL
+};
+
+struct syntax languages[] = {
+	{"C", ".c .h .cc .cpp .cxx .hh .hpp .hxx", "",
+	 "//", "/*", "*/", "\"'", SYN_PREPROC | SYN_ESCAPES,
+	 c_keywords, c_types, NULL, NULL},
+	{"Shell", ".sh .bash .zsh .ksh", "sh bash zsh ksh dash ash",
+	 "#", NULL, NULL, "\"'`", SYN_MULTILINE | SYN_VARIABLES | SYN_ESCAPES | SYN_WORDCOMMENT,
+	 sh_keywords, NULL, NULL, NULL},
+	{"JSON", ".json", "",
+	 NULL, NULL, NULL, "\"", SYN_KEYS | SYN_ESCAPES,
+	 json_keywords, NULL, NULL, NULL},
+	{"YAML", ".yaml .yml", "",
+	 "#", NULL, NULL, "\"'", SYN_KEYS | SYN_ESCAPES | SYN_WORDCOMMENT,
+	 yaml_keywords, NULL, NULL, NULL},
+	{"Log", ".log", "",
+	 NULL, NULL, NULL, "\"", SYN_DATES,
+	 log_keywords, NULL, log_errors, log_warnings},
+};
+
+#define LANGUAGES (sizeof(languages) / sizeof(struct syntax))
+
+//
+// Language detection
+//
+
+int in_list(char *list, char *word, int len) {
+	// Check if word is one of the space separated entries in list
+	char *end;
+
+	while (*list) {
+		end = list + strcspn(list, " ");
+		if (end - list == len && memcmp(list, word, len) == 0)
+			return 1;
+		list = end + strspn(end, " ");
+	}
+	return 0;
+}
+
+int has_ending(char *list, char *filename) {
+	// Check if filename ends with one of the entries in list
+	int namelen = strlen(filename);
+	char *end;
+
+	while (*list) {
+		end = list + strcspn(list, " ");
+		if (namelen > end - list && memcmp(filename + namelen - (end - list), list, end - list) == 0)
+			return 1;
+		list = end + strspn(end, " ");
+	}
+	return 0;
+}
+
+int interpreter(unsigned char *text, int len, char **name) {
+	// Find the program named on a #! first line, skipping env. Returns
+	// the length of the name.
+	unsigned char *p, *end, *word;
+
+	if (len < 2 || text[0] != '#' || text[1] != '!')
+		return 0;
+	end = memchr(text, '\n', len);
+	if (!end)
+		end = text + len;
+
+	p = text + 2;
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		word = p;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+			p++;
+		if (p == word)
+			return 0;
+
+		// Use the last component of the path
+		*name = (char *) word;
+		while (word < p) {
+			if (*word++ == '/')
+				*name = (char *) word;
+		}
+		if (p - (unsigned char *) *name != 3 || memcmp(*name, "env", 3) != 0)
+			return p - (unsigned char *) *name;
+	}
+}
+
+struct syntax *find_syntax(char *filename, unsigned char *text, int len) {
+	// Pick a language from the end of the file name or the program on a
+	// #! first line. Returns NULL if none applies.
+	struct syntax *syntax;
+	char *name;
+	int i, n;
+
+	for (i = 0; i < LANGUAGES; i++) {
+		syntax = languages + i;
+		if (has_ending(syntax->extensions, filename))
+			return syntax;
+	}
+
+	n = interpreter(text, len, &name);
+	if (n > 0) {
+		for (i = 0; i < LANGUAGES; i++) {
+			syntax = languages + i;
+			if (in_list(syntax->interpreters, name, n))
+				return syntax;
+		}
+	}
+	return NULL;
+}
+
+//
+// Lexer
+//
+
+int wordbyte(int ch) {
+	return (ch >= 'A' && ch <= 'Z')
+		|| (ch >= 'a' && ch <= 'z')
+		|| (ch >= '0' && ch <= '9')
+		|| ch == '_'
+		|| ch >= 0x80;
+}
+
+int in_words(char **words, unsigned char *word, int len) {
+	if (!words)
+		return 0;
+	for (; *words; words++) {
+		if ((*words)[0] == word[0] && strncmp(*words, (char *) word, len) == 0 && (*words)[len] == 0)
+			return 1;
+	}
+	return 0;
+}
+
+int starts_with(unsigned char *text, int len, char *prefix) {
+	int n;
+
+	if (!prefix)
+		return 0;
+	n = strlen(prefix);
+	return n <= len && memcmp(text, prefix, n) == 0;
+}
+
+int before_colon(unsigned char *text, int i, int len, int strict) {
+	// Check if a colon follows position i after any blanks. In strict
+	// mode the colon must end the line or be followed by a blank, as in
+	// YAML.
+	while (i < len && (text[i] == ' ' || text[i] == '\t'))
+		i++;
+	if (i == len || text[i] != ':')
+		return 0;
+	return !strict || i + 1 == len || text[i + 1] == ' ' || text[i + 1] == '\t';
+}
+
+int highlight(struct syntax *syntax, int state, unsigned char *text, int len,
+		unsigned char *attrs) {
+	// Lex a line that starts in state. Stores the class of each byte in
+	// attrs unless it is NULL and returns the state at the start of the
+	// next line.
+	int flags = syntax->flags;
+	int mode = state & 0xFF;
+	int quote = state >> 8;
+	int i = 0, start, strstart = -1, blank = 1;
+	int cls, ch, date;
+	unsigned char *end;
+
+	while (i < len) {
+		start = i;
+		ch = text[i];
+		cls = HL_TEXT;
+		if (mode == MODE_COMMENT) {
+			end = memmem(text + i, len - i, syntax->blockend, strlen(syntax->blockend));
+			if (end) {
+				i = end - text + strlen(syntax->blockend);
+				mode = MODE_NORMAL;
+			} else {
+				i = len;
+			}
+			cls = HL_COMMENT;
+		} else if (mode == MODE_STRING) {
+			while (i < len && text[i] != quote) {
+				if (text[i] == '\\' && (flags & SYN_ESCAPES) && i + 1 < len)
+					i++;
+				i++;
+			}
+			cls = HL_STRING;
+			if (i < len) {
+				i++;
+				mode = MODE_NORMAL;
+				if ((flags & SYN_KEYS) && before_colon(text, i, len, 0)) {
+					// Strings followed by a colon are keys in JSON and YAML
+					cls = HL_KEY;
+					if (attrs && strstart >= 0)
+						memset(attrs + strstart, HL_KEY, start - strstart);
+				}
+			}
+		} else if (mode == MODE_PREPROC) {
+			// Directives run to the end of the line or a comment
+			while (i < len && !starts_with(text + i, len - i, syntax->linecomment)
+					&& !starts_with(text + i, len - i, syntax->blockstart))
+				i++;
+			if (i < len)
+				mode = MODE_NORMAL;
+			cls = HL_PREPROC;
+		} else if (starts_with(text + i, len - i, syntax->linecomment)
+				&& (!(flags & SYN_WORDCOMMENT) || i == 0 || text[i - 1] == ' ' || text[i - 1] == '\t')) {
+			i = len;
+			cls = HL_COMMENT;
+		} else if (starts_with(text + i, len - i, syntax->blockstart)) {
+			i += strlen(syntax->blockstart);
+			mode = MODE_COMMENT;
+			cls = HL_COMMENT;
+		} else if (strchr(syntax->quotes, ch) && ch != 0 && (i == 0 || !wordbyte(text[i - 1]))) {
+			i++;
+			strstart = start;
+			quote = ch;
+			mode = MODE_STRING;
+			cls = HL_STRING;
+		} else if ((flags & SYN_PREPROC) && ch == '#' && blank) {
+			i++;
+			mode = MODE_PREPROC;
+			cls = HL_PREPROC;
+		} else if (ch >= '0' && ch <= '9' && (i == 0 || !wordbyte(text[i - 1]))) {
+			// Numbers take any letters after them as suffixes. In logs,
+			// numbers joined by separators are dates and times.
+			date = 0;
+			i++;
+			while (i < len) {
+				if ((flags & SYN_DATES) && (text[i] == ':' || text[i] == '-' || text[i] == '/')
+						&& i + 1 < len && text[i + 1] >= '0' && text[i + 1] <= '9') {
+					date = 1;
+				} else if (!wordbyte(text[i]) && text[i] != '.') {
+					break;
+				}
+				i++;
+			}
+			cls = date ? HL_DATE : HL_NUMBER;
+		} else if ((flags & SYN_VARIABLES) && ch == '$' && i + 1 < len) {
+			i++;
+			if (text[i] == '{') {
+				end = memchr(text + i, '}', len - i);
+				i = end ? end - text + 1 : len;
+			} else if (wordbyte(text[i])) {
+				while (i < len && wordbyte(text[i]))
+					i++;
+			} else {
+				i++;
+			}
+			cls = HL_VARIABLE;
+		} else if (wordbyte(ch)) {
+			while (i < len && (wordbyte(text[i])
+					|| ((flags & SYN_KEYS) && (text[i] == '-' || text[i] == '.'))))
+				i++;
+			if ((flags & SYN_KEYS) && before_colon(text, i, len, 1))
+				cls = HL_KEY;
+			else if (in_words(syntax->keywords, text + start, i - start))
+				cls = HL_KEYWORD;
+			else if (in_words(syntax->types, text + start, i - start))
+				cls = HL_TYPE;
+			else if (in_words(syntax->errors, text + start, i - start))
+				cls = HL_ERROR;
+			else if (in_words(syntax->warnings, text + start, i - start))
+				cls = HL_WARNING;
+		} else {
+			i++;
+		}
+
+		if (ch != ' ' && ch != '\t')
+			blank = 0;
+		if (attrs)
+			memset(attrs + start, cls, i - start);
+	}
+
+	// Strings and directives carry on past a backslash at the end
+	if (mode == MODE_STRING && !(flags & SYN_MULTILINE) && (len == 0 || text[len - 1] != '\\'))
+		mode = MODE_NORMAL;
+	if (mode == MODE_PREPROC && (len == 0 || text[len - 1] != '\\'))
+		mode = MODE_NORMAL;
+	return mode == MODE_STRING ? mode | (quote << 8) : mode;
+}
@@ -0,0 +1,58 @@
+//
+// Highlight classes
+//
+
+#define HL_TEXT              0
+#define HL_COMMENT           1
+#define HL_STRING            2
+#define HL_NUMBER            3
+#define HL_KEYWORD           4
+#define HL_TYPE              5
+#define HL_PREPROC           6
+#define HL_KEY               7
+#define HL_VARIABLE          8
+#define HL_ERROR             9
+#define HL_WARNING           10
+#define HL_DATE              11
+
+#define HL_CLASSES           12
+
+//
+// Language flags
+//
+
+#define SYN_PREPROC          0x01
+#define SYN_MULTILINE        0x02
+#define SYN_KEYS             0x04
+#define SYN_VARIABLES        0x08
+#define SYN_DATES            0x10
+#define SYN_ESCAPES          0x20
+#define SYN_WORDCOMMENT      0x40
+
+//
+// Languages
+//
+
+struct syntax {
+	char *name;
+	char *extensions; // File name endings separated by spaces
+	char *interpreters; // Programs named on a #! line separated by spaces
+	char *linecomment; // Starts a comment running to the end of the line
+	char *blockstart; // Starts a block comment
+	char *blockend; // Ends a block comment
+	char *quotes; // Characters that start and end strings
+	int flags;
+	char **keywords; // Words shown as HL_KEYWORD
+	char **types; // Words shown as HL_TYPE
+	char **errors; // Words shown as HL_ERROR
+	char **warnings; // Words shown as HL_WARNING
+};
+
+//
+// Lexer functions
+//
+
+struct syntax *find_syntax(char *filename, unsigned char *text, int len);
+
+int highlight(struct syntax *syntax, int state, unsigned char *text, int len,
+		unsigned char *attrs);
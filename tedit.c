@@ -1,26 +1,58 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <ncurses.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <linux/fs.h>
 #include <termios.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "keys.h"
+#include "syntax.h"
 
 #define NEW_LINE "\n"
 #define O_BINARY 0
 
 #define MINEXTEND      32768
+#define READCHUNK      (1 << 20)
 #define LINEBUF_EXTRA  32
 #define TABSIZE        8
+#define LOADERS        8
+#define UNDOCHUNK      (1 << 16)
+#define UNDOLIMIT      (64 << 20)
+#define UNDOTOTAL      (256 << 20)
+#define SPILLLIMIT     (1LL << 30)
+#define SAVECHUNK      (1 << 24)
+#define JOURNALBUF     (1 << 16)
+#define JOURNALDELAY   1000
+#define CHECKPOINTMIN  (1 << 16)
+#define REPLAYCOST     64
+#define COLSTEP        4096
+#define COLLINES       64
+#define UTF8MAX        4
+#define SYNTAXLINE     (1 << 16)
+#define SYNTAXSYNC     1000
+#define SYNTAXCHUNK    (1 << 20)
+#define MAXVIEWS       8
+#define MAXJUMPS       100
 
 #define CLRSCR           "\033[0J"
 #define CLREOL           "\033[K"
@@ -38,6 +70,21 @@
 
 #endif
 
+char *syntax_colors[HL_CLASSES] = {
+	TEXT_COLOR, // HL_TEXT
+	"\033[36m", // HL_COMMENT
+	"\033[32m", // HL_STRING
+	"\033[35m", // HL_NUMBER
+	"\033[33m", // HL_KEYWORD
+	"\033[32m", // HL_TYPE
+	"\033[35m", // HL_PREPROC
+	"\033[36m", // HL_KEY
+	"\033[36m", // HL_VARIABLE
+	"\033[31m", // HL_ERROR
+	"\033[33m", // HL_WARNING
+	"\033[35m", // HL_DATE
+};
+
 //
 // Editor data block
 //
@@ -52,6 +99,49 @@
 //
 
 struct env;
+struct editor;
+
+#define LOAD_QUEUED  0
+#define LOAD_RUNNING 1
+#define LOAD_DONE    2
+
+struct load {
+	char filename[FILENAME_MAX]; // File name as given
+	char path[FILENAME_MAX]; // Canonical file name
+	struct stat statbuf; // File status
+	unsigned char *buf; // Text buffer with room for the gap
+	int length; // Length of text
+	int loaded; // Number of bytes read so far
+	int error; // Error number if loading failed
+	int state; // Queued, running or done
+	int cancel; // Editor was closed, stop loading
+	struct editor *ed; // Editor to receive the text, NULL if closed
+	struct load *next; // Next file being loaded
+};
+
+struct lexjob {
+	struct editor *ed; // Editor the lines are from, NULL if closed
+	struct syntax *syntax; // Highlighting rules for the lines
+	int version; // Version of the text the lines were copied from
+	int line; // Line number of the first line
+	int state; // Lexer state at the start of the first line
+	int endpos; // Start of the line after the last one
+	int target; // Line the states are needed for
+	int targetpos; // Start of the target line
+	unsigned char *text; // Copy of the lines without line endings
+	int *states; // Length of each line, then the state after it
+	int lines; // Number of lines
+	int valid; // Lines still unchanged above later edits
+	int done; // Lexer is done with the lines
+	struct lexjob *next; // Next lines queued for the lexer
+};
+
+struct undochunk {
+	struct undochunk *prev; // Previously allocated chunk
+	int size; // Size of data area
+	int used; // Number of bytes allocated from data area
+	unsigned char data[]; // Undo records and contents
+};
 
 struct undo {
 	int pos; // Editor position
@@ -59,8 +149,118 @@ struct undo {
 	int inserted; // Size of inserted contents
 	unsigned char *undobuf; // Erased contents for undo
 	unsigned char *redobuf; // Inserted contents for redo
-	struct undo *next; // Next undo buffer
-	struct undo *prev; // Previous undo buffer
+	int reversed; // Erased contents are stored back to front
+	off_t spill; // Offset of contents in spill file, -1 if in memory
+	off_t checkpoint; // Offset of text after this change in spill file, -1 if none
+	long long replay; // Cost of reaching the state before this change from a checkpoint
+	int seq; // Number of undo buffer in order of creation, starting at 1
+	int depth; // Number of undo buffers up to the root of the undo tree
+	struct undo *prev; // Parent undo buffer, whose state this one changes
+	struct undo *child; // Child undo buffer to redo
+	struct undo *next; // Next undo buffer in time
+	struct undo *before; // Previous undo buffer in time
+};
+
+#define JOURNAL_MAGIC "TEDITJ01"
+#define JOURNAL_OFF   -2
+
+struct journal {
+	char magic[8]; // Journal file signature
+	unsigned long long dev; // Device of file the journal applies to
+	unsigned long long ino; // Inode of file
+	long long size; // Size of file
+	long long mtime; // Modification time of file
+	long long mtimensec; // Nanoseconds of modification time
+};
+
+#define HISTORY_MAGIC "TEDITU02"
+
+struct history {
+	char magic[8]; // Undo history file signature
+	unsigned long long dev; // Device of file the history applies to
+	unsigned long long ino; // Inode of file
+	long long size; // Size of file
+	long long mtime; // Modification time of file
+	long long mtimensec; // Nanoseconds of modification time
+	unsigned long long hash; // Hash of file contents, 0 if unknown
+	int count; // Number of undo records that follow
+	int current; // Number of the record matching the file, 0 for the root
+};
+
+struct branch {
+	int parent; // Number of the record this one changes, 0 for the root
+};
+
+struct record {
+	int pos; // Editor position
+	int erased; // Size of erased contents
+	int inserted; // Size of inserted contents, followed by the contents
+};
+
+struct span {
+	int len; // Length of text range
+	int orig; // Offset of range in file on disk, -1 if modified
+};
+
+struct colmark {
+	int pos; // Offset in line of first character at or after the mark
+	int col; // Column at pos
+};
+
+struct rowbreak {
+	int pos; // Offset in line where the row starts
+	int seen; // Offset of the last character looked at to place the break
+};
+
+struct colcache {
+	int linepos; // Start of line, -1 if unused
+	int length; // Length of line, -1 if unknown
+	struct colmark *marks; // Column every COLSTEP bytes of the line
+	int nmarks; // Number of valid column marks
+	int maxmarks; // Allocated number of column marks
+	int pos; // Offset in line of last column computed
+	int value; // Column at pos
+	struct rowbreak *rows; // Start of every row after the first when wrapped
+	int nrows; // Number of rows laid out after the first
+	int maxrows; // Allocated number of row offsets
+	int wrapped; // Rows are laid out up to the end of the line
+	int used; // Time of last use
+};
+
+struct mark {
+	int pos; // Text position once the tags above are applied
+	int shift; // Shift pending for the marks below
+	int moveto; // Position pending for the marks below, -1 if none
+	int prio; // Heap order keeping the tree balanced
+	struct mark *left; // Marks before this one
+	struct mark *right; // Marks after this one
+	struct mark *parent;
+};
+
+struct bookmark {
+	char *name;
+	struct mark *mark;
+	struct bookmark *next;
+};
+
+struct view {
+	int toppos; // Text position for top line of the view
+	int topline; // Line number for top of the view
+	int toprow; // Row of the top line at the top of the view when wrapped
+	int margin; // Position for leftmost column in the view
+	int linepos; // Text position for current line
+	int line; // Current document line
+	int col; // Current document column
+	int lastcol; // Remembered column from last horizontal navigation
+	int anchor; // Anchor position for selection
+	int wrap; // Long lines are wrapped into rows instead of scrolled
+	int cursory; // Row of the cursor in the view when wrapped
+	int cursorrows; // Rows of the cursor line shown when wrapped
+	int top; // Screen row of the view
+	int left; // Screen column of the view
+	int height; // Text lines shown in the view
+	int width; // Columns shown in the view
+	int version; // Version of the text last drawn, -1 to draw again
 };
 
 struct editor {
@@ -79,20 +279,99 @@ struct editor {
 	int lastcol; // Remembered column from last horizontal navigation
 	int anchor; // Anchor position for selection
 
-	struct undo *undohead; // Start of undo buffer list
-	struct undo *undotail; // End of undo buffer list
-	struct undo *undo; // Undo/redo boundary
+	struct undo *undohead; // Oldest undo buffer
+	struct undo *undotail; // Newest undo buffer
+	struct undo *undo; // Undo buffer for the current state, NULL at the root
+	struct undo *rootchild; // Undo buffer to redo from the root
+	struct undochunk *undoarena; // Most recent chunk of undo contents
+	struct undochunk *undorecs; // Most recent chunk of undo records
+	int undomemory; // Memory used for undo contents
+	struct undo *unspilled; // Oldest undo record with contents in memory
+	int spillfd; // Temporary file with older undo contents, -1 if none
+	off_t spillsize; // Size of spill file
+	struct undo *saveundo; // Undo record matching the file on disk
+	int savelost; // Text on disk can no longer be reached by undo
+	int loadhistory; // Undo history of an earlier session is on disk
 
 	int refresh; // Flag to trigger screen redraw
 	int lineupdate; // Flag to trigger redraw of current line
 	int dirty; // Dirty flag is set when the editor buffer has been changed
 
 	int newfile; // File is a new file
+	int changed; // File has been changed on disk since loaded or saved
+	struct stat filestat; // File status when last loaded or saved
+
+	int follow; // Follow mode appends data written to the file or pipe
+	int watch; // Inotify watch descriptor for the file
+	int pipefd; // Pipe that is still being read into the buffer
+	struct load *load; // Pending background load of the file
+
+	pid_t savepid; // Process writing a snapshot of the buffer to the file
+	int savefd; // Pipe reporting progress of the background save
+	int savelen; // Number of bytes being saved
+	int saved; // Number of bytes saved so far
+	int saveerr; // Error reported by the background save
+
+	struct span *spans; // Ranges of text unchanged or modified since last save
+	int nspans; // Number of spans, -1 if unknown
+	int maxspans; // Allocated number of spans
+
+	struct colcache cols[COLLINES]; // Column marks for recently used lines
+	int coltime; // Use counter for replacing column cache entries
+
+	int wrap; // Long lines are wrapped into rows instead of scrolled
+	int wrapcols; // Screen width the rows are laid out for
+	int toprow; // Row of the top line at the top of screen when wrapped
+	int cursory; // Screen row of the cursor when wrapped
+	int cursorrows; // Rows of the cursor line shown on screen when wrapped
+
+	int top; // Screen row of the current view
+	int left; // Screen column of the current view
+	int height; // Text lines shown in the current view
+	int width; // Columns shown in the current view
+	struct view views[MAXVIEWS]; // Views of the buffer, the current one is in the fields above
+	int nviews; // Number of views on screen
+	int curview; // Index of the current view
+	int layoutlines; // Screen lines the views are laid out for
+	int layoutcols; // Screen columns the views are laid out for
+
+	struct syntax *syntax; // Highlighting rules for the file, NULL if none
+	int *states; // Lexer state at the start of each line
+	int nstates; // Number of lines with a state
+	int maxstates; // Allocated number of states
+	int goodstates; // Lines at the start whose states match the text
+	int version; // Counts changes to the text
+	struct lexjob *lexjob; // Lines queued for the background lexer, NULL if none
+	int lexline; // Line the background lexer can go on from, -1 if unknown
+	int lexpos; // Position in that line
+	int syncline; // Other line the background lexer can go on from, -1 if none
+	int syncpos; // Position in that line
+
+	struct mark *marks; // Tree of positions that move with the text
+	struct bookmark *bookmarks; // Named bookmarks
+	struct mark *jumps[MAXJUMPS]; // Positions jumped away from, oldest first
+	int njumps; // Number of positions in the jump list
+	int jump; // Position in the jump list when going back, njumps if not
+	struct mark *lastedit; // Position after the last change, NULL if none
+
+	int journalfd; // Journal of unsaved changes, -1 if not started
+	char *journalbuf; // Journal records not written yet
+	int journallen; // Size of records not written yet
+	long long journaltime; // Time of oldest record not written yet
+	off_t journalsize; // Size of journal including records not written yet
+	off_t journalmark; // Size of journal when the running save started
+	int recover; // Journal of an earlier session was found for the file
 
 	struct env *env; // Reference global editor environment
 	struct editor *next; // Next editor.
 	struct editor *prev; // Previous editor
 
+	int registered; // Editor is in the file registry
+	unsigned int pathhash; // Registry hash of file name
+	unsigned int idhash; // Registry hash of device and inode
+	struct editor *pathnext; // Next editor in file name hash chain
+	struct editor *idnext; // Next editor in device and inode hash chain
+
 	char filename[FILENAME_MAX];
 };
 
@@ -105,889 +384,4194 @@ struct env {
 	char *search; // Search text.
 
 	char *linebuf; // Scratch buffer.
+	unsigned char *syntaxbuf; // Line copied out of the gap for the lexer
+	unsigned char *attrs; // Highlight class of each byte in a line
 
 	int cols; // Console columns
 	int lines; // Console lines
 
 	int untitled; // Counter for untitled files
+
+	int notifyfd; // Inotify descriptor for watched files
+
+	struct editor **bypath; // File registry hashed by file name
+	struct editor **byid; // File registry hashed by device and inode
+	int buckets; // Number of hash buckets in file registry
+	int files; // Number of editors in file registry
+
+	struct load *loads; // Files queued or being loaded in background
+	struct lexjob *lexjobs; // Lines queued or lexed in background
+	int threads; // Lock and wakeup pipe are set up
+	pthread_mutex_t lock; // Protects loads and lexjobs
+	pthread_cond_t queued; // Signals loaders that a file was queued
+	pthread_cond_t loaded; // Signals that a file has been loaded
+	pthread_cond_t lexqueued; // Signals the lexer that lines were queued
+	pthread_t loaders[LOADERS]; // Background loader threads
+	int nloaders; // Number of loader threads started
+	pthread_t lexer; // Background lexer thread
+	int lexing; // Lexer thread started
+	int stop; // Tells background threads to exit
+	int wakefd[2]; // Pipe used by background threads to wake up the event loop
+	volatile sig_atomic_t resized; // Window size changed since last redraw
+
+	struct editor *shown; // Editor whose views are on screen
+
+	long long undomemory; // Memory used for undo contents by all editors
 };
 
 //
-// Editor buffer functions
+// Undo arena
+//
+// Undo records and their contents are allocated in order from two lists
+// of chunks, one for the records and one for the contents. Records form
+// a tree: editing after an undo starts a new branch and keeps the old
+// one. When the contents use more memory than allowed, the oldest chunks
+// are written to a temporary file and read back only when undoing that
+// far. If the file grows too big, the oldest history is dropped and
+// what is left is copied to a new file.
 //
 
-void clear_undo(struct editor *ed) {
-	struct undo *undo = ed->undohead;
-	while (undo) {
-		struct undo *next = undo->next;
-		free(undo->undobuf);
-		free(undo->redobuf);
-		free(undo);
-		undo = next;
+void *arena_alloc(struct editor *ed, struct undochunk **arena, int size, int reserve) {
+	struct undochunk *chunk = *arena;
+	int used = chunk ? (chunk->used + 7) & ~7 : 0;
+	int chunksize;
+
+	if (!chunk || used + size > chunk->size) {
+		chunksize = size > reserve ? size : reserve;
+		if (chunksize < UNDOCHUNK)
+			chunksize = UNDOCHUNK;
+		chunk = (struct undochunk *) malloc(sizeof(struct undochunk) + chunksize);
+		if (!chunk)
+			return NULL;
+		chunk->prev = *arena;
+		chunk->size = chunksize;
+		*arena = chunk;
+		used = 0;
+		if (arena == &ed->undoarena) {
+			ed->undomemory += chunksize;
+			ed->env->undomemory += chunksize;
+		}
 	}
-	ed->undohead = ed->undotail = ed->undo = NULL;
+	chunk->used = used + size;
+	return chunk->data + used;
 }
 
-void reset_undo(struct editor *ed) {
-	while (ed->undotail != ed->undo) {
-		struct undo *undo = ed->undotail;
-		if (!undo) {
-			ed->undohead = NULL;
-			ed->undotail = NULL;
-			break;
-		}
-		ed->undotail = undo->prev;
-		if (undo->prev)
-			undo->prev->next = NULL;
-		free(undo->undobuf);
-		free(undo->redobuf);
-		free(undo);
+void arena_release(struct editor *ed, struct undochunk **arena, struct undochunk *chunk) {
+	if (arena == &ed->undoarena) {
+		ed->undomemory -= chunk->size;
+		ed->env->undomemory -= chunk->size;
 	}
-	ed->undo = ed->undotail;
+	free(chunk);
 }
 
-struct editor *create_editor(struct env *env) {
-	struct editor *ed = (struct editor *) malloc(sizeof(struct editor));
-	memset(ed, 0, sizeof(struct editor));
-	if (env->current) {
-		ed->next = env->current->next;
-		ed->prev = env->current;
-		env->current->next->prev = ed;
-		env->current->next = ed;
-	} else {
-		ed->next = ed->prev = ed;
+void *undo_alloc(struct editor *ed, int size, int reserve) {
+	return arena_alloc(ed, &ed->undoarena, size, reserve);
+}
+
+unsigned char *undo_extend(struct editor *ed, unsigned char *buf, int len, int extra) {
+	// Grow the most recent allocation in place, or move it to a new
+	// chunk with room to keep growing
+	struct undochunk *chunk = ed->undoarena;
+	unsigned char *newbuf;
+
+	if (buf + len == chunk->data + chunk->used && chunk->used + extra <= chunk->size) {
+		chunk->used += extra;
+		return buf;
 	}
-	ed->env = env;
-	env->current = ed;
-	return ed;
+	newbuf = undo_alloc(ed, len + extra, 2 * (len + extra));
+	if (newbuf)
+		memcpy(newbuf, buf, len);
+	return newbuf;
 }
 
-void delete_editor(struct editor *ed) {
-	if (ed->next == ed) {
-		ed->env->current = NULL;
-	} else {
-		ed->env->current = ed->prev;
+void seal_undo(struct undo *undo) {
+	// Text erased with backspace is collected back to front, put it in
+	// order once the record is complete
+	unsigned char *p, *q, c;
+
+	if (!undo->reversed)
+		return;
+	for (p = undo->undobuf, q = p + undo->erased - 1; p < q; p++, q--) {
+		c = *p;
+		*p = *q;
+		*q = c;
 	}
-	ed->next->prev = ed->prev;
-	ed->prev->next = ed->next;
-	if (ed->start)
-		free(ed->start);
-	clear_undo(ed);
-	free(ed);
+	undo->reversed = 0;
 }
 
-struct editor *find_editor(struct env *env, char *filename) {
-	char fn[FILENAME_MAX];
-	struct editor *ed = env->current;
-	struct editor *start = ed;
+long long replay_cost(struct undo *undo) {
+	// Estimate the work of applying an undo record in bytes
+	return (long long) undo->erased + undo->inserted + REPLAYCOST;
+}
 
-	if (!realpath(filename, fn))
-		strcpy(fn, filename);
+struct undo *add_undo(struct editor *ed, struct undo *parent) {
+	// Add an empty undo buffer changing the state of parent
+	struct undo *undo;
 
-	do {
-		if (strcmp(fn, ed->filename) == 0)
-			return ed;
-		ed = ed->next;
-	} while (ed != start);
-	return NULL;
+	undo = (struct undo *) arena_alloc(ed, &ed->undorecs, sizeof(struct undo), 0);
+	if (!undo)
+		return NULL;
+	memset(undo, 0, sizeof(struct undo));
+	undo->spill = -1;
+	undo->checkpoint = -1;
+	if (parent)
+		undo->replay = parent->checkpoint >= 0 ? 0 : parent->replay + replay_cost(parent);
+	undo->seq = ed->undotail ? ed->undotail->seq + 1 : 1;
+	undo->depth = parent ? parent->depth + 1 : 1;
+	undo->prev = parent;
+	if (parent)
+		parent->child = undo;
+	else
+		ed->rootchild = undo;
+
+	undo->before = ed->undotail;
+	if (ed->undotail)
+		ed->undotail->next = undo;
+	else
+		ed->undohead = undo;
+	ed->undotail = undo;
+	if (!ed->unspilled)
+		ed->unspilled = undo;
+	return undo;
 }
 
-int new_file(struct editor *ed, char *filename) {
-	if (*filename) {
-		strcpy(ed->filename, filename);
-	} else {
-		sprintf(ed->filename, "Untitled-%d", ++ed->env->untitled);
-		ed->newfile = 1;
+int spill_file() {
+	char name[FILENAME_MAX];
+	char *dir = getenv("TMPDIR");
+	int f;
+
+	if (!dir)
+		dir = "/tmp";
+	f = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (f < 0 && snprintf(name, sizeof(name), "%s/tedit-undo-XXXXXX", dir) < sizeof(name)) {
+		f = mkostemp(name, O_CLOEXEC);
+		if (f >= 0)
+			unlink(name);
 	}
+	return f;
+}
 
-	ed->start = (unsigned char *) malloc(MINEXTEND);
-	if (!ed->start)
+int spill_undo(struct editor *ed) {
+	// Move the contents in the oldest chunk to the spill file
+	struct undochunk **link = &ed->undoarena;
+	struct undochunk *chunk;
+	struct undo *undo;
+	struct iovec iov[2];
+	unsigned char *start, *end;
+	int len;
+
+	// The chunk being filled stays in memory
+	if (!*link || !(*link)->prev)
 		return -1;
-#ifdef DEBUG
-	memset(ed->start, 0, MINEXTEND);
-#endif
+	while ((*link)->prev)
+		link = &(*link)->prev;
+	chunk = *link;
+	start = chunk->data;
+	end = chunk->data + chunk->size;
+
+	if (ed->spillfd < 0) {
+		ed->spillfd = spill_file();
+		if (ed->spillfd < 0)
+			return -1;
+	}
 
-	ed->gap = ed->start;
-	ed->rest = ed->end = ed->gap + MINEXTEND;
-	ed->anchor = -1;
+	// Contents are allocated in the order of the records that own them
+	for (undo = ed->unspilled; undo; undo = undo->next) {
+		if (!undo->undobuf && !undo->redobuf)
+			continue;
+		if (!(undo->undobuf >= start && undo->undobuf < end)
+				&& !(undo->redobuf >= start && undo->redobuf < end))
+			break;
 
+		seal_undo(undo);
+		len = undo->erased + undo->inserted;
+		iov[0].iov_base = undo->undobuf;
+		iov[0].iov_len = undo->erased;
+		iov[1].iov_base = undo->redobuf;
+		iov[1].iov_len = undo->inserted;
+		if (pwritev(ed->spillfd, iov, 2, ed->spillsize) != len) {
+			ed->unspilled = undo;
+			return -1;
+		}
+		undo->spill = ed->spillsize;
+		undo->undobuf = undo->redobuf = NULL;
+		ed->spillsize += len;
+	}
+	ed->unspilled = undo;
+
+	*link = NULL;
+	arena_release(ed, &ed->undoarena, chunk);
 	return 0;
 }
 
-int load_file(struct editor *ed, char *filename) {
-	struct stat statbuf;
-	int length;
+int checkpoint_undo(struct editor *ed, struct undo *undo) {
+	// Write the current text, which is the state after undo, to the
+	// spill file so jumps in the history can start from there
+	struct iovec iov[3];
+	int len = (ed->gap - ed->start) + (ed->end - ed->rest);
 
-	if (!realpath(filename, ed->filename))
-		return -1;
-	int f = open(ed->filename, O_RDONLY | O_BINARY);
-	if (f < 0)
+	if (ed->spillfd < 0) {
+		ed->spillfd = spill_file();
+		if (ed->spillfd < 0)
+			return -1;
+	}
+	iov[0].iov_base = &len;
+	iov[0].iov_len = sizeof(int);
+	iov[1].iov_base = ed->start;
+	iov[1].iov_len = ed->gap - ed->start;
+	iov[2].iov_base = ed->rest;
+	iov[2].iov_len = ed->end - ed->rest;
+	if (pwritev(ed->spillfd, iov, 3, ed->spillsize) != sizeof(int) + len)
 		return -1;
+	undo->checkpoint = ed->spillsize;
+	ed->spillsize += sizeof(int) + len;
+	return 0;
+}
 
-	if (fstat(f, &statbuf) < 0)
-		goto err;
-	length = statbuf.st_size;
+void limit_memory(struct editor *ed) {
+	struct env *env = ed->env;
+	struct editor *e, *largest;
+
+	while (ed->undomemory > UNDOLIMIT && spill_undo(ed) == 0)
+		;
+	while (env->undomemory > UNDOTOTAL) {
+		largest = e = env->current;
+		do {
+			if (e->undomemory > largest->undomemory)
+				largest = e;
+			e = e->next;
+		} while (e != env->current);
+		if (spill_undo(largest) < 0)
+			break;
+	}
+}
 
-	ed->start = (unsigned char *) malloc(length + MINEXTEND);
-	if (!ed->start)
-		goto err;
-#ifdef DEBUG
-	memset(ed->start, 0, length + MINEXTEND);
-#endif
-	if (read(f, ed->start, length) != length)
-		goto err;
+off_t spill_bytes(struct editor *ed, struct undo *undo) {
+	// Space used by the contents and checkpoint of a record in the spill file
+	off_t size = undo->spill >= 0 ? undo->erased + undo->inserted : 0;
+	int len;
 
-	ed->gap = ed->start + length;
-	ed->rest = ed->end = ed->gap + MINEXTEND;
-	ed->anchor = -1;
+	if (undo->checkpoint >= 0
+			&& pread(ed->spillfd, &len, sizeof(int), undo->checkpoint) == sizeof(int))
+		size += sizeof(int) + len;
+	return size;
+}
 
-	close(f);
-	return 0;
+int copy_spill(int from, off_t src, int to, off_t dst, off_t len) {
+	unsigned char buf[4096];
+	ssize_t n;
 
-	err: close(f);
-	if (ed->start) {
-		free(ed->start);
-		ed->start = NULL;
+	while (len > 0) {
+		n = copy_file_range(from, &src, to, &dst, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			// Not supported here, copy through a buffer
+			n = pread(from, buf, len < sizeof(buf) ? len : sizeof(buf), src);
+			if (n <= 0 || pwrite(to, buf, n, dst) != n)
+				return -1;
+			src += n;
+			dst += n;
+		}
+		len -= n;
 	}
-	return -1;
+	return 0;
 }
 
-int save_file(struct editor *ed) {
-	int f;
+int compact_spill(struct editor *ed) {
+	// Copy the contents and checkpoints still in use to a new spill file
+	struct undo *undo;
+	off_t size, used;
+	int f, pass, len;
 
-	f = open(ed->filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	f = spill_file();
 	if (f < 0)
 		return -1;
-
-	if (write(f, ed->start, ed->gap - ed->start) != ed->gap - ed->start)
-		goto err;
-	if (write(f, ed->rest, ed->end - ed->rest) != ed->end - ed->rest)
-		goto err;
-
-	close(f);
-	ed->dirty = 0;
-	clear_undo(ed);
+	// The records only move to the new file once all of it is written
+	for (pass = 0; pass < 2; pass++) {
+		size = 0;
+		for (undo = ed->undohead; undo; undo = undo->next) {
+			if (undo->spill >= 0) {
+				used = undo->erased + undo->inserted;
+				if (!pass && copy_spill(ed->spillfd, undo->spill, f, size, used) < 0)
+					goto err;
+				if (pass)
+					undo->spill = size;
+				size += used;
+			}
+			if (undo->checkpoint >= 0) {
+				if (pread(ed->spillfd, &len, sizeof(int), undo->checkpoint) != sizeof(int))
+					goto err;
+				used = sizeof(int) + len;
+				if (!pass && copy_spill(ed->spillfd, undo->checkpoint, f, size, used) < 0)
+					goto err;
+				if (pass)
+					undo->checkpoint = size;
+				size += used;
+			}
+		}
+	}
+	close(ed->spillfd);
+	ed->spillfd = f;
+	ed->spillsize = size;
 	return 0;
 
 	err: close(f);
 	return -1;
 }
 
-int text_length(struct editor *ed) {
-	return (ed->gap - ed->start) + (ed->end - ed->rest);
-}
-
-unsigned char *text_ptr(struct editor *ed, int pos) {
-	unsigned char *p = ed->start + pos;
-	if (p >= ed->gap)
-		p += (ed->rest - ed->gap);
-	return p;
-}
-
-void move_gap(struct editor *ed, int pos, int minsize) {
-	int gapsize = ed->rest - ed->gap;
-	unsigned char *p = text_ptr(ed, pos);
-	if (minsize < 0)
-		minsize = 0;
-
-	if (minsize <= gapsize) {
-		if (p != ed->rest) {
-			if (p < ed->gap) {
-				memmove(p + gapsize, p, ed->gap - p);
-			} else {
-				memmove(ed->gap, ed->rest, p - ed->rest);
+void drop_history(struct editor *ed) {
+	// Drop the oldest changes until the spill file is down to half its
+	// limit. Changes leading to the current state are folded into the
+	// root of the tree, other branches starting before them go with them.
+	// Dropped records are marked with a depth of 0.
+	struct undo **path, *undo, *next, *last = NULL, *lastroot = NULL;
+	struct undo *newroot = NULL;
+	off_t live = 0;
+	int depth, k = 0, seq = 0;
+
+	depth = ed->undo ? ed->undo->depth : 0;
+	path = (struct undo **) malloc((depth + 1) * sizeof(struct undo *));
+	if (!path)
+		return;
+	for (undo = ed->undo; undo; undo = undo->prev)
+		path[undo->depth - 1] = undo;
+	path[depth] = NULL;
+	for (undo = ed->undohead; undo; undo = undo->next)
+		live += spill_bytes(ed, undo);
+
+	// Parents come before their children in time. Once the root has
+	// moved, the changes that started from the old one are gone too.
+	for (undo = ed->undohead; undo; undo = next) {
+		next = undo->next;
+		if (undo->prev ? undo->prev->depth == 0 : newroot != NULL) {
+			if (undo != path[k]) {
+				live -= spill_bytes(ed, undo);
+				undo->depth = 0;
+				continue;
 			}
-			ed->gap = ed->start + pos;
-			ed->rest = ed->gap + gapsize;
+			undo->prev = NULL;
 		}
-	} else {
-		int newsize;
-		unsigned char *start;
-		unsigned char *gap;
-		unsigned char *rest;
-		unsigned char *end;
-
-		if (gapsize + MINEXTEND > minsize)
-			minsize = gapsize + MINEXTEND;
-		newsize = (ed->end - ed->start) - gapsize + minsize;
-		start = (unsigned char *) malloc(newsize); // TODO check for out of memory
-		gap = start + pos;
-		rest = gap + minsize;
-		end = start + newsize;
-
-		if (p < ed->gap) {
-			memcpy(start, ed->start, pos);
-			memcpy(rest, p, ed->gap - p);
-			memcpy(end - (ed->end - ed->rest), ed->rest, ed->end - ed->rest);
-		} else {
-			memcpy(start, ed->start, ed->gap - ed->start);
-			memcpy(start + (ed->gap - ed->start), ed->rest, p - ed->rest);
-			memcpy(rest, p, ed->end - p);
+		if (!undo->prev && live > SPILLLIMIT / 2) {
+			if (undo == path[k])
+				newroot = path[k++];
+			live -= spill_bytes(ed, undo);
+			undo->depth = 0;
+			continue;
 		}
 
-		free(ed->start);
-		ed->start = start;
-		ed->gap = gap;
-		ed->rest = rest;
-		ed->end = end;
+		undo->depth = undo->prev ? undo->prev->depth + 1 : 1;
+		undo->replay = !undo->prev ? 0 : undo->prev->checkpoint >= 0 ? 0
+				: undo->prev->replay + replay_cost(undo->prev);
+		undo->seq = ++seq;
+		undo->before = last;
+		if (last)
+			last->next = undo;
+		else
+			ed->undohead = undo;
+		last = undo;
+		if (!undo->prev)
+			lastroot = undo;
 	}
+	if (last)
+		last->next = NULL;
+	else
+		ed->undohead = NULL;
+	ed->undotail = last;
+
+	if (ed->undo && ed->undo->depth == 0)
+		ed->undo = NULL;
+	if (ed->rootchild && ed->rootchild->depth == 0)
+		ed->rootchild = path[k] ? path[k] : lastroot;
+	if (ed->saveundo ? ed->saveundo->depth == 0 : newroot != NULL) {
+		// The saved state is only kept if it became the root
+		if (ed->saveundo != newroot)
+			ed->savelost = 1;
+		ed->saveundo = NULL;
+	}
+	while (ed->unspilled && ed->unspilled->depth == 0)
+		ed->unspilled = ed->unspilled->next;
+	free(path);
 
-#ifdef DEBUG
-	memset(ed->gap, 0, ed->rest - ed->gap);
-#endif
+	compact_spill(ed);
 }
 
-void close_gap(struct editor *ed) {
-	int len = text_length(ed);
-	move_gap(ed, len, 1);
-	ed->start[len] = 0;
+void limit_undo(struct editor *ed) {
+	limit_memory(ed);
+	if (ed->spillsize > SPILLLIMIT)
+		drop_history(ed);
 }
 
-int get(struct editor *ed, int pos) {
-	unsigned char *p = text_ptr(ed, pos);
-	if (p >= ed->end)
-		return -1;
-	return *p;
+unsigned char *undo_text(struct editor *ed, struct undo *undo, int redo) {
+	// Return the erased or inserted contents of an undo record, reading
+	// them back into a temporary buffer if they were spilled
+	int len = redo ? undo->inserted : undo->erased;
+	unsigned char *buf;
+
+	if (undo->spill < 0 || len == 0)
+		return redo ? undo->redobuf : undo->undobuf;
+	buf = malloc(len);
+	if (buf && pread(ed->spillfd, buf, len, undo->spill + (redo ? undo->erased : 0)) != len) {
+		free(buf);
+		buf = NULL;
+	}
+	return buf;
 }
 
-int copy(struct editor *ed, unsigned char *buf, int pos, int len) {
-	unsigned char *bufptr = buf;
-	unsigned char *p = ed->start + pos;
-	if (p >= ed->gap)
-		p += (ed->rest - ed->gap);
+void clear_undo(struct editor *ed) {
+	struct undochunk *chunk;
 
-	while (len > 0) {
-		if (p == ed->end)
-			break;
-		*bufptr++ = *p;
-		len--;
-		if (++p == ed->gap)
-			p = ed->rest;
+	while ((chunk = ed->undoarena)) {
+		ed->undoarena = chunk->prev;
+		arena_release(ed, &ed->undoarena, chunk);
+	}
+	while ((chunk = ed->undorecs)) {
+		ed->undorecs = chunk->prev;
+		arena_release(ed, &ed->undorecs, chunk);
 	}
+	if (ed->spillfd >= 0)
+		close(ed->spillfd);
+	ed->spillfd = -1;
+	ed->spillsize = 0;
+	ed->undohead = ed->undotail = ed->undo = ed->rootchild = ed->unspilled = NULL;
+	ed->saveundo = NULL;
+	ed->savelost = 0;
+}
 
-	return bufptr - buf;
+//
+// Marks
+//
+// Marks are positions in the text that move with it as it is edited.
+// They are kept in a treap ordered by position. An edit splits off the
+// marks after it and shifts them all with a tag on the root of that part,
+// which is pushed down lazily, so it costs O(log n) however many marks
+// there are. Marks inside replaced text end up after the new text.
+//
+
+void tag_mark(struct mark *m, int shift, int moveto) {
+	// Apply a shift, or a move if moveto is not -1, to the subtree at m
+	if (!m)
+		return;
+	if (moveto >= 0) {
+		m->pos = m->moveto = moveto;
+		m->shift = 0;
+	} else {
+		m->pos += shift;
+		if (m->moveto >= 0)
+			m->moveto += shift;
+		else
+			m->shift += shift;
+	}
 }
 
-void replace(struct editor *ed, int pos, int len, unsigned char *buf,
-		int bufsize, int doundo) {
-	unsigned char *p = ed->start + pos;
-	struct undo *undo;
+void push_mark(struct mark *m) {
+	tag_mark(m->left, m->shift, m->moveto);
+	tag_mark(m->right, m->shift, m->moveto);
+	m->shift = 0;
+	m->moveto = -1;
+}
 
-	// Store undo information
-	if (doundo) {
-		reset_undo(ed);
-		undo = ed->undotail;
-		if (undo && len == 0 && bufsize == 1 && undo->erased == 0
-				&& pos == undo->pos + undo->inserted) {
-			// Insert character at end of current redo buffer
-			undo->redobuf = realloc(undo->redobuf, undo->inserted + 1);
-			undo->redobuf[undo->inserted] = *buf;
-			undo->inserted++;
-		} else if (undo && len == 1 && bufsize == 0 && undo->inserted == 0
-				&& pos == undo->pos) {
-			// Erase character at end of current undo buffer
-			undo->undobuf = realloc(undo->undobuf, undo->erased + 1);
-			undo->undobuf[undo->erased] = get(ed, pos);
-			undo->erased++;
-		} else if (undo && len == 1 && bufsize == 0 && undo->inserted == 0
-				&& pos == undo->pos - 1) {
-			// Erase character at beginning of current undo buffer
-			undo->pos--;
-			undo->undobuf = realloc(undo->undobuf, undo->erased + 1);
-			memmove(undo->undobuf + 1, undo->undobuf, undo->erased);
-			undo->undobuf[0] = get(ed, pos);
-			undo->erased++;
-		} else {
-			// Create new undo buffer
-			undo = (struct undo *) malloc(sizeof(struct undo));
-			if (ed->undotail)
-				ed->undotail->next = undo;
-			undo->prev = ed->undotail;
-			undo->next = NULL;
-			ed->undotail = ed->undo = undo;
-			if (!ed->undohead)
-				ed->undohead = undo;
-
-			undo->pos = pos;
-			undo->erased = len;
-			undo->inserted = bufsize;
-			undo->undobuf = undo->redobuf = NULL;
-			if (len > 0) {
-				undo->undobuf = malloc(len);
-				copy(ed, undo->undobuf, pos, len);
-			}
-			if (bufsize > 0) {
-				undo->redobuf = malloc(bufsize);
-				memcpy(undo->redobuf, buf, bufsize);
-			}
-		}
-	}
+void set_child(struct mark *m, struct mark **link, struct mark *child) {
+	*link = child;
+	if (child)
+		child->parent = m;
+}
 
-	if (bufsize == 0 && p <= ed->gap && p + len >= ed->gap) {
-		// Handle deletions at the edges of the gap
-		ed->rest += len - (ed->gap - p);
-		ed->gap = p;
-	} else {
-		// Move the gap
-		move_gap(ed, pos + len, bufsize - len);
+void split_marks(struct mark *m, int pos, struct mark **before, struct mark **after) {
+	// Split the marks into those before pos and those at or after it
+	struct mark *child;
 
-		// Replace contents
-		memcpy(ed->start + pos, buf, bufsize);
-		ed->gap = ed->start + pos + bufsize;
+	if (!m) {
+		*before = *after = NULL;
+		return;
+	}
+	push_mark(m);
+	m->parent = NULL;
+	if (m->pos < pos) {
+		split_marks(m->right, pos, &child, after);
+		set_child(m, &m->right, child);
+		*before = m;
+	} else {
+		split_marks(m->left, pos, before, &child);
+		set_child(m, &m->left, child);
+		*after = m;
 	}
-
-	// Mark buffer as dirty
-	ed->dirty = 1;
-}
-
-void insert(struct editor *ed, int pos, unsigned char *buf, int bufsize) {
-	replace(ed, pos, 0, buf, bufsize, 1);
 }
 
-void erase_section(struct editor *ed, int pos, int len) {
-	replace(ed, pos, len, NULL, 0, 1);
+struct mark *join_marks(struct mark *a, struct mark *b) {
+	// Join two trees where all marks in a come before those in b
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->prio > b->prio) {
+		push_mark(a);
+		set_child(a, &a->right, join_marks(a->right, b));
+		return a;
+	} else {
+		push_mark(b);
+		set_child(b, &b->left, join_marks(a, b->left));
+		return b;
+	}
 }
 
-//
-// Navigation functions
-//
+int mark_pos(struct mark *m) {
+	// Apply the tags still pending above the mark, nearest first
+	int pos = m->pos;
 
-int line_length(struct editor *ed, int linepos) {
-	int pos = linepos;
-	while (1) {
-		int ch = get(ed, pos);
-		if (ch < 0 || ch == '\n' || ch == '\r')
-			break;
-		pos++;
+	for (m = m->parent; m; m = m->parent) {
+		if (m->moveto >= 0)
+			pos = m->moveto;
+		else
+			pos += m->shift;
 	}
+	return pos;
+}
 
-	return pos - linepos;
+void insert_mark(struct editor *ed, struct mark *m) {
+	struct mark *before, *after;
+
+	split_marks(ed->marks, m->pos, &before, &after);
+	ed->marks = join_marks(join_marks(before, m), after);
 }
 
-int line_start(struct editor *ed, int pos) {
-	while (1) {
-		if (pos == 0)
-			break;
-		if (get(ed, pos - 1) == '\n')
-			break;
-		pos--;
-	}
+struct mark *add_mark(struct editor *ed, int pos) {
+	struct mark *m = (struct mark *) calloc(1, sizeof(struct mark));
 
-	return pos;
+	if (!m)
+		return NULL;
+	m->pos = pos;
+	m->moveto = -1;
+	m->prio = rand();
+	insert_mark(ed, m);
+	return m;
 }
 
-int next_line(struct editor *ed, int pos) {
-	while (1) {
-		int ch = get(ed, pos);
-		if (ch < 0)
-			return -1;
-		pos++;
-		if (ch == '\n')
-			return pos;
+void push_above(struct mark *m) {
+	if (m->parent) {
+		push_above(m->parent);
+		push_mark(m->parent);
 	}
 }
 
-int prev_line(struct editor *ed, int pos) {
-	if (pos == 0)
-		return -1;
-
-	while (pos > 0) {
-		int ch = get(ed, --pos);
-		if (ch == '\n')
-			break;
-	}
+void unlink_mark(struct editor *ed, struct mark *m) {
+	// Take the mark out of the tree, leaving its position up to date
+	struct mark *p = m->parent;
 
-	while (pos > 0) {
-		int ch = get(ed, --pos);
-		if (ch == '\n')
-			return pos + 1;
-	}
+	push_above(m);
+	push_mark(m);
+	set_child(p, !p ? &ed->marks : p->left == m ? &p->left : &p->right,
+			join_marks(m->left, m->right));
+	m->left = m->right = m->parent = NULL;
+}
 
-	return 0;
+void remove_mark(struct editor *ed, struct mark *m) {
+	if (!m)
+		return;
+	unlink_mark(ed, m);
+	free(m);
 }
 
-int column(struct editor *ed, int linepos, int col) {
-	unsigned char *p = text_ptr(ed, linepos);
-	int c = 0;
-	while (col > 0) {
-		if (p == ed->end)
-			break;
-		if (*p == '\t') {
-			int spaces = TABSIZE - c % TABSIZE;
-			c += spaces;
-		} else {
-			c++;
-		}
-		col--;
-		if (++p == ed->gap)
-			p = ed->rest;
-	}
-	return c;
+void set_mark(struct editor *ed, struct mark *m, int pos) {
+	unlink_mark(ed, m);
+	m->pos = pos;
+	insert_mark(ed, m);
 }
 
-void moveto(struct editor *ed, int pos, int center) {
-	int scroll = 0;
-	for (;;) {
-		int cur = ed->linepos + ed->col;
-		if (pos < cur) {
-			if (pos >= ed->linepos) {
-				ed->col = pos - ed->linepos;
-			} else {
-				ed->col = 0;
-				ed->linepos = prev_line(ed, ed->linepos);
-				ed->line--;
+void update_marks(struct editor *ed, int pos, int len, int newlen) {
+	// Called for every change to the text
+	struct mark *before, *inside, *after;
 
-				if (ed->topline > ed->line) {
-					ed->toppos = ed->linepos;
-					ed->topline--;
-					ed->refresh = 1;
-					scroll = 1;
-				}
-			}
-		} else if (pos > cur) {
-			int next = next_line(ed, ed->linepos);
-			if (next == -1) {
-				ed->col = text_length(ed) - ed->linepos;
-				break;
-			} else if (pos < next) {
-				ed->col = pos - ed->linepos;
-			} else {
-				ed->col = 0;
-				ed->linepos = next;
-				ed->line++;
+	if (!ed->marks)
+		return;
+	split_marks(ed->marks, pos + 1, &before, &after);
+	split_marks(after, pos + len, &inside, &after);
+	tag_mark(inside, 0, pos + newlen);
+	tag_mark(after, newlen - len, -1);
+	ed->marks = join_marks(join_marks(before, inside), after);
+}
 
-				if (ed->line >= ed->topline + ed->env->lines) {
-					ed->toppos = next_line(ed, ed->toppos);
-					ed->topline++;
-					ed->refresh = 1;
-					scroll = 1;
-				}
-			}
-		} else {
-			break;
-		}
-	}
+void free_marks(struct mark *m) {
+	if (!m)
+		return;
+	free_marks(m->left);
+	free_marks(m->right);
+	free(m);
+}
 
-	if (scroll && center) {
-		int tl = ed->line - ed->env->lines / 2;
-		if (tl < 0)
-			tl = 0;
-		for (;;) {
-			if (ed->topline > tl) {
-				ed->toppos = prev_line(ed, ed->toppos);
-				ed->topline--;
-			} else if (ed->topline < tl) {
-				ed->toppos = next_line(ed, ed->toppos);
-				ed->topline++;
-			} else {
-				break;
-			}
+void push_jump(struct editor *ed) {
+	// Remember the cursor position before jumping away from it. Jumping
+	// after going back forgets the positions that were gone back over.
+	int pos = ed->linepos + ed->col;
+	struct mark *m;
+
+	while (ed->njumps > ed->jump)
+		remove_mark(ed, ed->jumps[--ed->njumps]);
+	if (ed->njumps == 0 || mark_pos(ed->jumps[ed->njumps - 1]) != pos) {
+		if (ed->njumps == MAXJUMPS) {
+			remove_mark(ed, ed->jumps[0]);
+			memmove(ed->jumps, ed->jumps + 1, (MAXJUMPS - 1) * sizeof(struct mark *));
+			ed->njumps--;
 		}
+		m = add_mark(ed, pos);
+		if (m)
+			ed->jumps[ed->njumps++] = m;
 	}
+	ed->jump = ed->njumps;
 }
 
 //
-// Text selection
+// Editor buffer functions
 //
 
-int get_selection(struct editor *ed, int *start, int *end) {
-	if (ed->anchor == -1) {
-		*start = *end = -1;
-		return 0;
-	} else {
-		int pos = ed->linepos + ed->col;
-		if (pos == ed->anchor) {
-			*start = *end = -1;
-			return 0;
-		} else if (pos < ed->anchor) {
-			*start = pos;
-			*end = ed->anchor;
-		} else {
-			*start = ed->anchor;
-			*end = pos;
-		}
-	}
-	return 1;
-}
 
-int get_selected_text(struct editor *ed, char *buffer, int size) {
-	int selstart, selend, len;
+//
+// File registry
+//
 
-	if (!get_selection(ed, &selstart, &selend))
-		return 0;
-	len = selend - selstart;
-	if (len >= size)
-		return 0;
-	copy(ed, buffer, selstart, len);
-	buffer[len] = 0;
-	return len;
+unsigned int hash_path(char *filename) {
+	unsigned int h = 2166136261u;
+	while (*filename)
+		h = (h ^ (unsigned char) *filename++) * 16777619u;
+	return h;
 }
 
-void update_selection(struct editor *ed, int select) {
-	if (select) {
-		if (ed->anchor == -1)
-			ed->anchor = ed->linepos + ed->col;
-		ed->refresh = 1;
-	} else {
-		if (ed->anchor != -1)
-			ed->refresh = 1;
-		ed->anchor = -1;
-	}
+unsigned int hash_id(struct stat *statbuf) {
+	return (unsigned int) statbuf->st_ino * 2654435761u
+			^ (unsigned int) statbuf->st_dev;
 }
 
-int erase_selection(struct editor *ed) {
-	int selstart, selend;
+void unregister_editor(struct editor *ed) {
+	struct env *env = ed->env;
+	struct editor **p;
 
-	if (!get_selection(ed, &selstart, &selend))
-		return 0;
-	moveto(ed, selstart, 0);
-	erase_section(ed, selstart, selend - selstart);
-	ed->anchor = -1;
-	ed->refresh = 1;
-	return 1;
+	if (!ed->registered)
+		return;
+	p = &env->bypath[ed->pathhash & (env->buckets - 1)];
+	while (*p != ed)
+		p = &(*p)->pathnext;
+	*p = ed->pathnext;
+	p = &env->byid[ed->idhash & (env->buckets - 1)];
+	while (*p != ed)
+		p = &(*p)->idnext;
+	*p = ed->idnext;
+	ed->registered = 0;
+	env->files--;
 }
 
-void select_all(struct editor *ed) {
-	ed->anchor = 0;
-	ed->refresh = 1;
-	moveto(ed, text_length(ed), 0);
-}
+void link_editor(struct editor *ed) {
+	struct env *env = ed->env;
+	int i = ed->pathhash & (env->buckets - 1);
+	int j = ed->idhash & (env->buckets - 1);
 
-//
-// Screen functions
-//
+	ed->pathnext = env->bypath[i];
+	env->bypath[i] = ed;
+	ed->idnext = env->byid[j];
+	env->byid[j] = ed;
+}
 
-void get_console_size(struct env *env) {
-	struct winsize ws;
+void register_editor(struct editor *ed) {
+	struct env *env = ed->env;
 
-	ioctl(0, TIOCGWINSZ, &ws);
-	env->cols = ws.ws_col;
-	env->lines = ws.ws_row - 1;
+	unregister_editor(ed);
+	if (env->files >= env->buckets) {
+		struct editor *e = ed;
+		int buckets = env->buckets ? env->buckets * 2 : 64;
+		struct editor **bypath = calloc(buckets, sizeof(struct editor *));
+		struct editor **byid = calloc(buckets, sizeof(struct editor *));
+
+		if (bypath && byid) {
+			free(env->bypath);
+			free(env->byid);
+			env->bypath = bypath;
+			env->byid = byid;
+			env->buckets = buckets;
+			do {
+				if (e->registered)
+					link_editor(e);
+				e = e->next;
+			} while (e != ed);
+		} else {
+			// Keep the old tables with longer chains
+			free(bypath);
+			free(byid);
+			if (!env->buckets)
+				return;
+		}
+	}
 
-	env->linebuf = realloc(env->linebuf, env->cols + LINEBUF_EXTRA);
+	ed->pathhash = hash_path(ed->filename);
+	ed->idhash = hash_id(&ed->filestat);
+	link_editor(ed);
+	ed->registered = 1;
+	env->files++;
 }
 
-void outch(char c) {
-	putchar(c);
+int same_file(struct stat *a, struct stat *b) {
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+			&& a->st_size == b->st_size
+			&& a->st_mtim.tv_sec == b->st_mtim.tv_sec
+			&& a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
 }
 
-void outbuf(char *buf, int len) {
-	fwrite(buf, 1, len, stdout);
+void set_filestat(struct editor *ed, struct stat *statbuf) {
+	int moved = statbuf->st_dev != ed->filestat.st_dev
+			|| statbuf->st_ino != ed->filestat.st_ino;
+
+	ed->filestat = *statbuf;
+	if (moved)
+		register_editor(ed);
 }
 
-void outstr(char *str) {
-	fputs(str, stdout);
+//
+// Background loading
+//
+
+void read_file(struct load *load, struct env *env) {
+	unsigned char *buf;
+	int f, n, length;
+
+	if (!realpath(load->filename, load->path))
+		goto err;
+	f = open(load->path, O_RDONLY | O_BINARY);
+	if (f < 0)
+		goto err;
+	if (fstat(f, &load->statbuf) < 0)
+		goto errclose;
+	if (load->statbuf.st_size > INT_MAX - MINEXTEND) {
+		errno = EFBIG;
+		goto errclose;
+	}
+	length = load->statbuf.st_size;
+
+	buf = (unsigned char *) malloc(length + MINEXTEND);
+	if (!buf)
+		goto errclose;
+#ifdef DEBUG
+	memset(buf, 0, length + MINEXTEND);
+#endif
+	posix_fadvise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	// The buffer is handed to the editor right away and the text is
+	// published chunk by chunk, so the top of a large file can be
+	// shown while the rest is still being read
+	pthread_mutex_lock(&env->lock);
+	load->length = length;
+	load->buf = buf;
+	pthread_mutex_unlock(&env->lock);
+
+	for (n = 0; n < length;) {
+		int cancel;
+		ssize_t rc = read(f, buf + n,
+				length - n < READCHUNK ? length - n : READCHUNK);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			if (rc == 0)
+				errno = EIO;
+			goto errclose;
+		}
+		n += rc;
+
+		pthread_mutex_lock(&env->lock);
+		load->loaded = n;
+		cancel = load->cancel;
+		pthread_cond_broadcast(&env->loaded);
+		pthread_mutex_unlock(&env->lock);
+		write(env->wakefd[1], "", 1);
+		if (cancel)
+			break;
+	}
+
+	close(f);
+	return;
+
+	errclose: close(f);
+	err: load->error = errno;
 }
 
-void clear_screen() {
-	outstr(CLRSCR);
+void start_threads(struct env *env) {
+	// Set up what background threads share with the event loop
+	if (env->threads)
+		return;
+	pthread_mutex_init(&env->lock, NULL);
+	pthread_cond_init(&env->queued, NULL);
+	pthread_cond_init(&env->loaded, NULL);
+	pthread_cond_init(&env->lexqueued, NULL);
+	pipe2(env->wakefd, O_NONBLOCK | O_CLOEXEC);
+	env->threads = 1;
 }
 
-void gotoxy(int col, int line) {
-	char buf[32];
+void *load_worker(void *arg) {
+	struct env *env = (struct env *) arg;
+
+	pthread_mutex_lock(&env->lock);
+	while (!env->stop) {
+		struct load *load = env->loads;
+		while (load && load->state != LOAD_QUEUED)
+			load = load->next;
+		if (!load) {
+			pthread_cond_wait(&env->queued, &env->lock);
+			continue;
+		}
 
-	sprintf(buf, GOTOXY, line + 1, col + 1);
-	outstr(buf);
+		load->state = LOAD_RUNNING;
+		pthread_mutex_unlock(&env->lock);
+		read_file(load, env);
+		pthread_mutex_lock(&env->lock);
+		load->state = LOAD_DONE;
+		pthread_cond_broadcast(&env->loaded);
+		write(env->wakefd[1], "", 1);
+	}
+	pthread_mutex_unlock(&env->lock);
+	return NULL;
 }
 
-int prompt(struct editor *ed, char *msg) {
-	int maxlen, len, ch;
-	char *buf = ed->env->linebuf;
+int queue_load(struct editor *ed, char *filename, int first) {
+	struct env *env = ed->env;
+	struct load *load = (struct load *) calloc(1, sizeof(struct load));
+	struct load **p;
 
-	gotoxy(0, ed->env->lines);
-	outstr(STATUS_COLOR);
-	outstr(msg);
-	outstr(CLREOL);
+	if (!load)
+		return -1;
+	if (!env->nloaders) {
+		start_threads(env);
+		while (env->nloaders < LOADERS) {
+			if (pthread_create(&env->loaders[env->nloaders], NULL,
+					load_worker, env) != 0)
+				break;
+			env->nloaders++;
+		}
+	}
 
-	len = 0;
-	maxlen = ed->env->cols - strlen(msg) - 1;
-	len = get_selected_text(ed, buf, maxlen);
-	outbuf(buf, len);
+	strcpy(load->filename, filename);
+	load->ed = ed;
+	ed->load = load;
 
-	for (;;) {
-		fflush(stdout);
-		ch = getkey();
-		if (ch == KEY_ESC) {
-			return 0;
-		} else if (ch == KEY_ENTER) {
-			buf[len] = 0;
-			return len > 0;
-		} else if (ch == KEY_BACKSPACE) {
-			if (len > 0) {
-				outstr("\b \b");
-				len--;
-			}
-		} else if (ch >= ' ' && ch < 0x100 && len < maxlen) {
-			outch(ch);
-			buf[len++] = ch;
-		}
+	// Register the editor right away so opening the file again finds it
+	// while it is loading
+	if (!realpath(filename, ed->filename))
+		strcpy(ed->filename, filename);
+	register_editor(ed);
+
+	pthread_mutex_lock(&env->lock);
+	for (p = &env->loads; *p && !first; p = &(*p)->next)
+		;
+	load->next = *p;
+	*p = load;
+	if (env->nloaders) {
+		pthread_cond_signal(&env->queued);
+	} else {
+		load->state = LOAD_RUNNING;
+		pthread_mutex_unlock(&env->lock);
+		read_file(load, env);
+		pthread_mutex_lock(&env->lock);
+		load->state = LOAD_DONE;
 	}
+	pthread_mutex_unlock(&env->lock);
+	return 0;
 }
 
-int ask() {
-	int ch = getchar();
-	return ch == 'y' || ch == 'Y';
+void unlink_load(struct env *env, struct load *load) {
+	struct load **p = &env->loads;
+	while (*p != load)
+		p = &(*p)->next;
+	*p = load->next;
 }
 
-//
-// Display functions
-//
+void cancel_load(struct editor *ed) {
+	struct env *env = ed->env;
+	struct load *load = ed->load;
+
+	// The text buffer belongs to the load until it has completed
+	pthread_mutex_lock(&env->lock);
+	if (load->state == LOAD_RUNNING) {
+		// Loader is still using it, it is freed when done
+		load->ed = NULL;
+		load->cancel = 1;
+		load = NULL;
+	} else {
+		unlink_load(env, load);
+	}
+	pthread_mutex_unlock(&env->lock);
 
-void display_message(struct editor *ed, char *fmt, ...) {
-	va_list args;
+	if (load) {
+		free(load->buf);
+		free(load);
+	}
+	ed->start = NULL;
+	ed->load = NULL;
+}
 
-	va_start(args, fmt);
-	gotoxy(0, ed->env->lines);
-	outstr(STATUS_COLOR);
-	vprintf(fmt, args);
-	outstr(CLREOL TEXT_COLOR);
-	fflush(stdout);
-	va_end(args);
+void stop_threads(struct env *env) {
+	if (!env->threads)
+		return;
+	pthread_mutex_lock(&env->lock);
+	env->stop = 1;
+	pthread_cond_broadcast(&env->queued);
+	pthread_cond_signal(&env->lexqueued);
+	pthread_mutex_unlock(&env->lock);
+	while (env->nloaders > 0)
+		pthread_join(env->loaders[--env->nloaders], NULL);
+	if (env->lexing)
+		pthread_join(env->lexer, NULL);
+	close(env->wakefd[0]);
+	close(env->wakefd[1]);
 }
 
-void draw_full_statusline(struct editor *ed) {
-	struct env *env = ed->env;
-	int namewidth = env->cols - 19;
+//
+// Edit journal
+//
+// Every change to a buffer is appended to a journal next to the file
+// until the buffer is saved or closed. If the editor dies, the journal
+// is replayed on top of the file the next time it is opened.
+//
 
-	gotoxy(0, env->lines);
-	sprintf(env->linebuf,
-			STATUS_COLOR "%*.*s%c Ln %-6dCol %-4d" CLREOL TEXT_COLOR,
-			-namewidth, namewidth, ed->filename, ed->dirty ? '*' : ' ',
-			ed->line + 1, column(ed, ed->linepos, ed->col) + 1);
-	outstr(env->linebuf);
-#ifdef DEBUG
-	gotoxy(0, env->lines - 1);
-	sprintf(env->linebuf,
-			STATUS_COLOR "[%02X%02X%02X%02X%02X%02X]" TEXT_COLOR,
-			last_keys[0], last_keys[1], last_keys[2], last_keys[3], last_keys[4],
-			last_keys[5]);
-	outstr(env->linebuf);
-#endif
+long long now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-void display_line(struct editor *ed, int pos, int fullline) {
-	int hilite = 0;
-	int col = 0;
-	int margin = ed->margin;
-	int maxcol = ed->env->cols + margin;
-	char *bufptr = ed->env->linebuf;
-	unsigned char *p = text_ptr(ed, pos);
-	int selstart, selend, ch;
-	char *s;
+int sidecar_name(struct editor *ed, char *name, char *kind) {
+	char *base;
 
-	get_selection(ed, &selstart, &selend);
-	while (col < maxcol) {
-		if (margin == 0) {
-			if (!hilite && pos >= selstart && pos < selend) {
-				for (s = SELECT_COLOR; *s; s++)
-					*bufptr++ = *s;
-				hilite = 1;
-			} else if (hilite && pos >= selend) {
-				for (s = TEXT_COLOR; *s; s++)
-					*bufptr++ = *s;
-				hilite = 0;
-			}
-		}
+	// Only files that exist on disk have journals and history
+	if (ed->newfile || !ed->filestat.st_ino)
+		return -1;
+	base = strrchr(ed->filename, '/');
+	base = base ? base + 1 : ed->filename;
+	if (snprintf(name, FILENAME_MAX, "%.*s.%s.tedit-%s", (int) (base - ed->filename),
+			ed->filename, base, kind) >= FILENAME_MAX)
+		return -1;
+	return 0;
+}
 
-		if (p == ed->end)
-			break;
-		ch = *p;
-		if (ch == '\r' || ch == '\n')
-			break;
+void journal_header(struct editor *ed, struct journal *header) {
+	memset(header, 0, sizeof(struct journal));
+	memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+	header->dev = ed->filestat.st_dev;
+	header->ino = ed->filestat.st_ino;
+	header->size = ed->filestat.st_size;
+	header->mtime = ed->filestat.st_mtim.tv_sec;
+	header->mtimensec = ed->filestat.st_mtim.tv_nsec;
+}
 
-		if (ch == '\t') {
-			int spaces = TABSIZE - col % TABSIZE;
-			while (spaces > 0 && col < maxcol) {
-				if (margin > 0) {
-					margin--;
-				} else {
-					*bufptr++ = ' ';
-				}
-				col++;
-				spaces--;
-			}
-		} else {
-			if (margin > 0) {
-				margin--;
-			} else {
-				*bufptr++ = ch;
-			}
-			col++;
-		}
+void close_journal(struct editor *ed, int remove) {
+	char name[FILENAME_MAX];
 
-		if (++p == ed->gap)
-			p = ed->rest;
-		pos++;
+	if (ed->journalfd >= 0) {
+		if (remove && sidecar_name(ed, name, "journal") == 0)
+			unlink(name);
+		close(ed->journalfd);
 	}
+	ed->journalfd = -1;
+	ed->journallen = 0;
+	ed->journalsize = 0;
+}
 
-	if (hilite) {
-		while (col < maxcol) {
-			*bufptr++ = ' ';
-			col++;
-		}
-	} else {
-		if (col == margin)
-			*bufptr++ = ' ';
-	}
+int open_journal(struct editor *ed) {
+	char name[FILENAME_MAX];
+	struct journal header;
+	int f;
 
-	if (col < maxcol) {
-		for (s = CLREOL; *s; s++)
-			*bufptr++ = *s;
-		if (fullline) {
-			memcpy(bufptr, "\r\n", 2);
-			bufptr += 2;
-		}
-	}
+	if (sidecar_name(ed, name, "journal") < 0)
+		goto fail;
+	f = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (f < 0)
+		goto fail;
 
-	if (hilite) {
-		for (s = TEXT_COLOR; *s; s++)
-			*bufptr++ = *s;
+	// Another editor may be journaling the same file
+	if (flock(f, LOCK_EX | LOCK_NB) < 0) {
+		close(f);
+		goto fail;
 	}
+	journal_header(ed, &header);
+	if (ftruncate(f, 0) < 0 || write(f, &header, sizeof(header)) != sizeof(header)) {
+		close(f);
+		unlink(name);
+		goto fail;
+	}
+	ed->journalfd = f;
+	ed->journalsize = sizeof(header);
+	return 0;
 
-	outbuf(ed->env->linebuf, bufptr - ed->env->linebuf);
-}
-
-void update_line(struct editor *ed) {
-	gotoxy(0, ed->line - ed->topline);
-	display_line(ed, ed->linepos, 0);
+	fail: ed->journalfd = JOURNAL_OFF;
+	return -1;
 }
 
-void draw_screen(struct editor *ed) {
-	int pos;
-	int i;
-
-	gotoxy(0, 0);
-	outstr(TEXT_COLOR);
-	pos = ed->toppos;
-	for (i = 0; i < ed->env->lines; i++) {
-		if (pos < 0) {
-			outstr(CLREOL "\r\n");
-		} else {
-			display_line(ed, pos, 1);
-			pos = next_line(ed, pos);
+int flush_journal(struct editor *ed) {
+	char *p = ed->journalbuf;
+	ssize_t n;
+
+	while (p < ed->journalbuf + ed->journallen) {
+		n = write(ed->journalfd, p, ed->journalbuf + ed->journallen - p);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			// Stop journaling rather than keep a journal with holes
+			close_journal(ed, 1);
+			ed->journalfd = JOURNAL_OFF;
+			return -1;
 		}
+		p += n;
 	}
+	ed->journallen = 0;
+	return 0;
 }
 
-void position_cursor(struct editor *ed) {
-	int col = column(ed, ed->linepos, ed->col);
-	gotoxy(col - ed->margin, ed->line - ed->topline);
-}
+void journal_replace(struct editor *ed, int pos, int len, unsigned char *buf, int bufsize) {
+	struct record rec;
+	struct iovec iov[2];
 
-//
-// Cursor movement
-//
+	if (ed->journalfd == JOURNAL_OFF)
+		return;
+	if (ed->journalfd < 0 && open_journal(ed) < 0)
+		return;
+	if (!ed->journalbuf) {
+		ed->journalbuf = malloc(JOURNALBUF);
+		if (!ed->journalbuf) {
+			close_journal(ed, 1);
+			ed->journalfd = JOURNAL_OFF;
+			return;
+		}
+	}
 
-void adjust(struct editor *ed) {
-	int col;
-	int ll = line_length(ed, ed->linepos);
-	ed->col = ed->lastcol;
-	if (ed->col > ll)
-		ed->col = ll;
+	rec.pos = pos;
+	rec.erased = len;
+	rec.inserted = bufsize;
+	if (ed->journallen == 0)
+		ed->journaltime = now_ms();
+	ed->journalsize += sizeof(rec) + bufsize;
 
-	col = column(ed, ed->linepos, ed->col);
-	while (col < ed->margin) {
-		ed->margin -= 4;
-		if (ed->margin < 0)
-			ed->margin = 0;
-		ed->refresh = 1;
+	// Batch small records, write large ones straight from the caller
+	if (ed->journallen + sizeof(rec) + bufsize > JOURNALBUF && flush_journal(ed) < 0)
+		return;
+	if (sizeof(rec) + bufsize <= JOURNALBUF) {
+		memcpy(ed->journalbuf + ed->journallen, &rec, sizeof(rec));
+		if (bufsize > 0)
+			memcpy(ed->journalbuf + ed->journallen + sizeof(rec), buf, bufsize);
+		ed->journallen += sizeof(rec) + bufsize;
+		return;
 	}
-
-	while (col - ed->margin >= ed->env->cols) {
-		ed->margin += 4;
-		ed->refresh = 1;
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = bufsize;
+	if (writev(ed->journalfd, iov, 2) != sizeof(rec) + bufsize) {
+		close_journal(ed, 1);
+		ed->journalfd = JOURNAL_OFF;
 	}
 }
 
-void up(struct editor *ed, int select) {
-	int newpos = prev_line(ed, ed->linepos);
-	if (newpos < 0)
+void restart_journal(struct editor *ed) {
+	// The file now holds the text as it was when the save started. Keep
+	// only the changes made since then, relative to the new file.
+	struct journal header;
+	char *tail;
+	off_t start = ed->journalmark > sizeof(header) ? ed->journalmark : sizeof(header);
+	off_t len;
+
+	if (ed->journalfd == JOURNAL_OFF)
+		ed->journalfd = -1;
+	if (ed->journalfd < 0 || flush_journal(ed) < 0)
+		return;
+	len = ed->journalsize - start;
+	if (len <= 0) {
+		close_journal(ed, 1);
 		return;
-
-	update_selection(ed, select);
-
-	ed->linepos = newpos;
-	ed->line--;
-	if (ed->line < ed->topline) {
-		ed->toppos = ed->linepos;
-		ed->topline = ed->line;
-		ed->refresh = 1;
 	}
 
-	adjust(ed);
+	tail = malloc(len);
+	journal_header(ed, &header);
+	if (!tail || pread(ed->journalfd, tail, len, start) != len || ftruncate(ed->journalfd, 0) < 0
+			|| pwrite(ed->journalfd, &header, sizeof(header), 0) != sizeof(header)
+			|| pwrite(ed->journalfd, tail, len, sizeof(header)) != len
+			|| lseek(ed->journalfd, 0, SEEK_END) < 0) {
+		close_journal(ed, 1);
+		ed->journalfd = JOURNAL_OFF;
+	} else {
+		ed->journalsize = sizeof(header) + len;
+	}
+	free(tail);
 }
 
-void down(struct editor *ed, int select) {
-	int newpos = next_line(ed, ed->linepos);
-	if (newpos < 0)
+void journal_appended(struct editor *ed, int pos, off_t oldsize) {
+	// The file grew from oldsize and the new bytes were added to the end
+	// of the text at pos without going through replace(). Base the
+	// journal on the file as it is now: it starts by cutting the new
+	// bytes off again and ends by adding them back at the end.
+	struct journal header;
+	struct record rec;
+	char *body;
+	off_t len;
+
+	if (ed->journalfd < 0 || flush_journal(ed) < 0)
 		return;
+	len = ed->journalsize - sizeof(header);
+	if (len <= 0) {
+		// Nothing journaled yet, start over with the new file
+		close_journal(ed, 1);
+		return;
+	}
 
-	update_selection(ed, select);
-
-	ed->linepos = newpos;
-	ed->line++;
-
-	if (ed->line >= ed->topline + ed->env->lines) {
-		ed->toppos = next_line(ed, ed->toppos);
-		ed->topline++;
-		ed->refresh = 1;
+	body = malloc(len);
+	journal_header(ed, &header);
+	rec.pos = oldsize;
+	rec.erased = ed->filestat.st_size - oldsize;
+	rec.inserted = 0;
+	if (!body || pread(ed->journalfd, body, len, sizeof(header)) != len
+			|| pwrite(ed->journalfd, &header, sizeof(header), 0) != sizeof(header)
+			|| pwrite(ed->journalfd, &rec, sizeof(rec), sizeof(header)) != sizeof(rec)
+			|| pwrite(ed->journalfd, body, len, sizeof(header) + sizeof(rec)) != len
+			|| lseek(ed->journalfd, 0, SEEK_END) < 0) {
+		free(body);
+		close_journal(ed, 1);
+		ed->journalfd = JOURNAL_OFF;
+		return;
 	}
+	free(body);
+	ed->journalsize += sizeof(rec);
+	if (ed->journalmark > sizeof(header))
+		ed->journalmark += sizeof(rec);
 
-	adjust(ed);
+	// The gap is at the end after appending
+	journal_replace(ed, pos, 0, ed->start + pos, ed->gap - ed->start - pos);
 }
 
-void left(struct editor *ed, int select) {
-	update_selection(ed, select);
-	if (ed->col > 0) {
-		ed->col--;
-	} else {
-		int newpos = prev_line(ed, ed->linepos);
-		if (newpos < 0)
-			return;
+int sync_journals(struct env *env) {
+	// Write out journal records that have been waiting for a while and
+	// make them durable. Returns the number of milliseconds until the
+	// next journal is due, or -1 if nothing is pending.
+	struct editor *ed = env->current;
+	long long now = now_ms();
+	int timeout = -1;
+	int wait;
 
-		ed->col = line_length(ed, newpos);
-		ed->linepos = newpos;
-		ed->line--;
-		if (ed->line < ed->topline) {
-			ed->toppos = ed->linepos;
-			ed->topline = ed->line;
-			ed->refresh = 1;
+	do {
+		if (ed->journalfd >= 0 && ed->journallen > 0) {
+			wait = ed->journaltime + JOURNALDELAY - now;
+			if (wait <= 0) {
+				if (flush_journal(ed) == 0)
+					fdatasync(ed->journalfd);
+			} else if (timeout < 0 || wait < timeout) {
+				timeout = wait;
+			}
 		}
-	}
-
-	ed->lastcol = ed->col;
-	adjust(ed);
+		ed = ed->next;
+	} while (ed != env->current);
+	return timeout;
 }
 
-void right(struct editor *ed, int select) {
-	update_selection(ed, select);
-	if (ed->col < line_length(ed, ed->linepos)) {
-		ed->col++;
-	} else {
-		int newpos = next_line(ed, ed->linepos);
-		if (newpos < 0)
-			return;
-
-		ed->col = 0;
-		ed->linepos = newpos;
-		ed->line++;
+struct editor *create_editor(struct env *env) {
+	struct editor *ed = (struct editor *) malloc(sizeof(struct editor));
+	int i;
 
-		if (ed->line >= ed->topline + ed->env->lines) {
-			ed->toppos = next_line(ed, ed->toppos);
-			ed->topline++;
-			ed->refresh = 1;
-		}
+	memset(ed, 0, sizeof(struct editor));
+	if (env->current) {
+		ed->next = env->current->next;
+		ed->prev = env->current;
+		env->current->next->prev = ed;
+		env->current->next = ed;
+	} else {
+		ed->next = ed->prev = ed;
 	}
-
-	ed->lastcol = ed->col;
-	adjust(ed);
+	ed->env = env;
+	ed->watch = ed->pipefd = ed->savefd = ed->nspans = ed->journalfd = -1;
+	ed->spillfd = -1;
+	for (i = 0; i < COLLINES; i++)
+		ed->cols[i].linepos = -1;
+	ed->height = env->lines;
+	ed->width = env->cols;
+	env->current = ed;
+	return ed;
 }
 
-int wordchar(int ch) {
-	return (ch >= 'A' && ch <= 'Z')
-		|| (ch >= 'a' && ch <= 'z')
-		|| (ch >= '0' && ch <= '9');
-}
+void delete_editor(struct editor *ed) {
+	struct bookmark *b;
+	int i;
+
+	if (ed->next == ed) {
+		ed->env->current = NULL;
+	} else {
+		ed->env->current = ed->prev;
+	}
+	ed->next->prev = ed->prev;
+	ed->prev->next = ed->next;
+	unregister_editor(ed);
+	if (ed->env->shown == ed)
+		ed->env->shown = NULL;
+	if (ed->load)
+		cancel_load(ed);
+	if (ed->watch >= 0)
+		inotify_rm_watch(ed->env->notifyfd, ed->watch);
+	if (ed->pipefd >= 0)
+		close(ed->pipefd);
+	if (ed->savepid) {
+		// Let the background save run to completion
+		close(ed->savefd);
+		waitpid(ed->savepid, NULL, 0);
+	}
+	if (ed->start)
+		free(ed->start);
+	free(ed->spans);
+	free(ed->states);
+	free_marks(ed->marks);
+	while (ed->bookmarks) {
+		b = ed->bookmarks;
+		ed->bookmarks = b->next;
+		free(b->name);
+		free(b);
+	}
+	if (ed->lexjob) {
+		// The lexer may still be using the lines, they are freed when done
+		pthread_mutex_lock(&ed->env->lock);
+		ed->lexjob->ed = NULL;
+		pthread_mutex_unlock(&ed->env->lock);
+	}
+	for (i = 0; i < COLLINES; i++) {
+		free(ed->cols[i].marks);
+		free(ed->cols[i].rows);
+	}
+	close_journal(ed, 1);
+	free(ed->journalbuf);
+	clear_undo(ed);
+	free(ed);
+}
+
+struct editor *find_editor(struct env *env, char *filename) {
+	char fn[FILENAME_MAX];
+	struct stat statbuf;
+	struct editor *ed;
+
+	if (!env->buckets)
+		return NULL;
+
+	// Look up by device and inode first, this also finds hard links
+	if (stat(filename, &statbuf) == 0) {
+		ed = env->byid[hash_id(&statbuf) & (env->buckets - 1)];
+		for (; ed; ed = ed->idnext) {
+			if (ed->filestat.st_dev == statbuf.st_dev
+					&& ed->filestat.st_ino == statbuf.st_ino)
+				return ed;
+		}
+	}
+
+	if (!realpath(filename, fn))
+		strcpy(fn, filename);
+	ed = env->bypath[hash_path(fn) & (env->buckets - 1)];
+	for (; ed; ed = ed->pathnext) {
+		if (strcmp(fn, ed->filename) == 0)
+			return ed;
+	}
+	return NULL;
+}
+
+int new_file(struct editor *ed, char *filename) {
+	if (*filename) {
+		strcpy(ed->filename, filename);
+		register_editor(ed);
+	} else {
+		sprintf(ed->filename, "Untitled-%d", ++ed->env->untitled);
+		ed->newfile = 1;
+	}
+	ed->syntax = find_syntax(ed->filename, NULL, 0);
+
+	ed->start = (unsigned char *) malloc(MINEXTEND);
+	if (!ed->start)
+		return -1;
+#ifdef DEBUG
+	memset(ed->start, 0, MINEXTEND);
+#endif
+
+	ed->gap = ed->start;
+	ed->rest = ed->end = ed->gap + MINEXTEND;
+	ed->anchor = -1;
+
+	return 0;
+}
+
+int watch_file(struct editor *ed) {
+	struct env *env = ed->env;
+
+	if (!env->notifyfd) {
+		env->notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (env->notifyfd < 0) {
+			env->notifyfd = 0;
+			return -1;
+		}
+	}
+	if (ed->watch < 0)
+		ed->watch = inotify_add_watch(env->notifyfd, ed->filename, IN_MODIFY | IN_ATTRIB
+				| IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+	return ed->watch;
+}
+
+int text_length(struct editor *ed) {
+	return (ed->gap - ed->start) + (ed->end - ed->rest);
+}
+
+unsigned char *text_ptr(struct editor *ed, int pos) {
+	unsigned char *p = ed->start + pos;
+	if (p >= ed->gap)
+		p += (ed->rest - ed->gap);
+	return p;
+}
+
+//
+// Modified ranges
+//
+// The span list describes the text as a sequence of ranges that are
+// either unchanged from the file on disk (orig is the file offset) or
+// modified since the file was loaded or saved (orig is -1).
+//
+
+int merge_spans(struct span *a, struct span *b) {
+	if (a->orig < 0 ? b->orig >= 0 : a->orig + a->len != b->orig)
+		return 0;
+	a->len += b->len;
+	return 1;
+}
+
+int grow_spans(struct editor *ed, int n) {
+	struct span *spans;
+	int maxspans;
+
+	if (n <= ed->maxspans)
+		return 0;
+	maxspans = ed->maxspans ? ed->maxspans * 2 : 16;
+	while (maxspans < n)
+		maxspans *= 2;
+	spans = realloc(ed->spans, maxspans * sizeof(struct span));
+	if (!spans) {
+		// Without the list every save is a full rewrite
+		ed->nspans = -1;
+		return -1;
+	}
+	ed->spans = spans;
+	ed->maxspans = maxspans;
+	return 0;
+}
+
+void reset_spans(struct editor *ed) {
+	// The text is identical to the file on disk
+	int length = (ed->gap - ed->start) + (ed->end - ed->rest);
+
+	ed->nspans = 0;
+	if (length > 0 && grow_spans(ed, 1) == 0) {
+		ed->spans[0].len = length;
+		ed->spans[0].orig = 0;
+		ed->nspans = 1;
+	}
+}
+
+void append_span(struct editor *ed, int len, int orig) {
+	struct span *span;
+
+	if (ed->nspans < 0 || len <= 0 || grow_spans(ed, ed->nspans + 1) < 0)
+		return;
+	span = ed->spans + ed->nspans;
+	span->len = len;
+	span->orig = orig;
+	if (ed->nspans == 0 || !merge_spans(span - 1, span))
+		ed->nspans++;
+}
+
+void update_spans(struct editor *ed, int pos, int len, int newlen) {
+	struct span parts[3];
+	struct span *s;
+	int i, j, k, n, np, offset, end, tail, removed, last;
+
+	if (ed->nspans < 0)
+		return;
+	n = ed->nspans;
+	s = ed->spans;
+
+	// Find the spans holding the first and last replaced byte
+	i = 0;
+	offset = 0;
+	while (i < n && offset + s[i].len <= pos)
+		offset += s[i++].len;
+	j = i;
+	end = offset;
+	while (j < n && end + s[j].len < pos + len)
+		end += s[j++].len;
+
+	// Replace them with the unchanged head, the new text and the unchanged tail
+	np = 0;
+	if (i < n && pos > offset) {
+		parts[np].len = pos - offset;
+		parts[np++].orig = s[i].orig;
+	}
+	if (newlen > 0) {
+		parts[np].len = newlen;
+		parts[np++].orig = -1;
+	}
+	if (j < n && end + s[j].len > pos + len) {
+		tail = end + s[j].len - (pos + len);
+		parts[np].len = tail;
+		parts[np++].orig = s[j].orig < 0 ? -1 : s[j].orig + s[j].len - tail;
+	}
+	removed = j < n ? j + 1 - i : n - i;
+
+	if (grow_spans(ed, n - removed + np) < 0)
+		return;
+	s = ed->spans;
+	memmove(s + i + np, s + i + removed, (n - i - removed) * sizeof(struct span));
+	memcpy(s + i, parts, np * sizeof(struct span));
+	n += np - removed;
+
+	// Join neighbouring spans so that typing does not fragment the list
+	k = i > 0 ? i - 1 : 0;
+	last = i + np;
+	while (k < last && k + 1 < n) {
+		if (merge_spans(s + k, s + k + 1)) {
+			memmove(s + k + 1, s + k + 2, (n - k - 2) * sizeof(struct span));
+			n--;
+			last--;
+		} else {
+			k++;
+		}
+	}
+	ed->nspans = n;
+}
+
+//
+// UTF-8
+//
+// Text is shown as UTF-8. Bytes that are not part of a valid sequence
+// take one column each and are shown as '?'. Plain ASCII is found 16
+// bytes at a time so runs of it are measured and copied without
+// decoding.
+//
+
+struct range {
+	int first;
+	int last;
+};
+
+struct range zero_width[] = {
+	{0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x0610, 0x061A},
+	{0x064B, 0x065F}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+	{0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E},
+	{0x2060, 0x2064}, {0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+	{0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF},
+};
+
+struct range double_width[] = {
+	{0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+	{0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+	{0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+	{0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+	{0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+	{0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+	{0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+	{0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+	{0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+	{0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+	{0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+	{0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+	{0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+	{0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F64F},
+	{0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+	{0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+int in_ranges(int ch, struct range *table, int n) {
+	int lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ch > table[mid].last)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < n && ch >= table[lo].first;
+}
+
+int char_width(int ch) {
+	// Return the columns taken by a code point
+	if (ch < 0x300)
+		return 1;
+	if (in_ranges(ch, zero_width, sizeof(zero_width) / sizeof(struct range)))
+		return 0;
+	if (ch >= 0x1100 && in_ranges(ch, double_width, sizeof(double_width) / sizeof(struct range)))
+		return 2;
+	return 1;
+}
+
+int printable(int ch) {
+	// Control characters from C1 would be taken as escapes by the terminal
+	return ch >= 0xA0;
+}
+
+int plain_run(unsigned char *p, int len) {
+	// Return how many bytes from p are ASCII other than tab and line
+	// breaks, so each takes exactly one column
+	int n = 0;
+#ifdef __SSE2__
+	__m128i tab = _mm_set1_epi8('\t');
+	__m128i lf = _mm_set1_epi8('\n');
+	__m128i cr = _mm_set1_epi8('\r');
+	__m128i v, special;
+	int mask;
+
+	while (n + 16 <= len) {
+		// The top bit of each byte is set for non-ASCII and special bytes
+		v = _mm_loadu_si128((__m128i *) (p + n));
+		special = _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+				_mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+		mask = _mm_movemask_epi8(_mm_or_si128(v, special));
+		if (mask)
+			return n + __builtin_ctz(mask);
+		n += 16;
+	}
+#endif
+	while (n < len && p[n] < 0x80 && p[n] != '\t' && p[n] != '\n' && p[n] != '\r')
+		n++;
+	return n;
+}
+
+int plain_text(struct editor *ed, unsigned char *p, int max) {
+	// Return the length of the plain run at p up to the gap or max bytes
+	int len = (p < ed->gap ? ed->gap : ed->end) - p;
+
+	return plain_run(p, len < max ? len : max);
+}
+
+unsigned char *skip_bytes(struct editor *ed, unsigned char *p, int len) {
+	// Advance p by len bytes of text, jumping over the gap
+	if (p < ed->gap && p + len >= ed->gap)
+		p += ed->rest - ed->gap;
+	return p + len;
+}
+
+int decode_char(struct editor *ed, unsigned char *p, int *len) {
+	// Decode the character at p. Stores its length and returns its code
+	// point, or -1 with length 1 if the byte does not start a valid
+	// sequence.
+	int ch = *p, more, min, i;
+
+	*len = 1;
+	if (ch < 0x80)
+		return ch;
+	if (ch >= 0xC2 && ch <= 0xDF) {
+		more = 1;
+		min = 0x80;
+		ch &= 0x1F;
+	} else if (ch >= 0xE0 && ch <= 0xEF) {
+		more = 2;
+		min = 0x800;
+		ch &= 0x0F;
+	} else if (ch >= 0xF0 && ch <= 0xF4) {
+		more = 3;
+		min = 0x10000;
+		ch &= 0x07;
+	} else {
+		return -1;
+	}
+
+	for (i = 0; i < more; i++) {
+		if (++p == ed->gap)
+			p = ed->rest;
+		if (p == ed->end || (*p & 0xC0) != 0x80)
+			return -1;
+		ch = (ch << 6) | (*p & 0x3F);
+	}
+	if (ch < min || ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF))
+		return -1;
+	*len = more + 1;
+	return ch;
+}
+
+int char_columns(struct editor *ed, unsigned char *p, int col, int *len) {
+	// Return the columns taken by the character at p when it starts at
+	// column col and store its length
+	int ch;
+
+	if (*p < 0x80) {
+		*len = 1;
+		return *p == '\t' ? TABSIZE - col % TABSIZE : 1;
+	}
+	ch = decode_char(ed, p, len);
+	return ch < 0 ? 1 : char_width(ch);
+}
+
+int char_length(struct editor *ed, int pos) {
+	// Return the length of the character at pos
+	int len;
+
+	if (pos >= text_length(ed))
+		return 1;
+	decode_char(ed, text_ptr(ed, pos), &len);
+	return len;
+}
+
+int char_start(struct editor *ed, int pos, int limit) {
+	// Return the start of the character holding the byte at pos, not
+	// looking back before limit
+	int start = pos, len;
+
+	if (pos >= text_length(ed))
+		return pos;
+	while (start > limit && start > pos - (UTF8MAX - 1) && (*text_ptr(ed, start) & 0xC0) == 0x80)
+		start--;
+	if (start < pos && decode_char(ed, text_ptr(ed, start), &len) >= 0 && start + len > pos)
+		return start;
+	return pos;
+}
+
+//
+// Column cache
+//
+// Columns in long lines are found by expanding tabs and wide characters
+// from the nearest mark before the position. Marks are recorded for recently used lines
+// as columns are computed and dropped when the text before them changes.
+// In wrap mode the same entries hold where each row of the line starts.
+//
+
+void clear_columns(struct editor *ed) {
+	int i;
+
+	for (i = 0; i < COLLINES; i++)
+		ed->cols[i].linepos = -1;
+}
+
+struct colcache *find_columns(struct editor *ed, int linepos, int create) {
+	struct colcache *e, *oldest = ed->cols;
+	int i;
+
+	for (i = 0; i < COLLINES; i++) {
+		e = ed->cols + i;
+		if (e->linepos == linepos) {
+			e->used = ++ed->coltime;
+			return e;
+		}
+		if (e->linepos < 0 || (oldest->linepos >= 0 && e->used < oldest->used))
+			oldest = e;
+	}
+	if (!create)
+		return NULL;
+
+	e = oldest;
+	e->linepos = linepos;
+	e->length = -1;
+	e->nmarks = 0;
+	e->pos = e->value = 0;
+	e->nrows = e->wrapped = 0;
+	e->used = ++ed->coltime;
+	return e;
+}
+
+void update_columns(struct editor *ed, int pos, int len, unsigned char *buf, int newlen) {
+	struct colcache *e;
+	int i, offset;
+
+	for (i = 0; i < COLLINES; i++) {
+		e = ed->cols + i;
+		if (e->linepos < 0)
+			continue;
+		if (pos < e->linepos) {
+			// Text before the line moves it or joins it with another
+			if (pos + len <= e->linepos)
+				e->linepos += newlen - len;
+			else
+				e->linepos = -1;
+			continue;
+		}
+
+		// Text past the end of the line leaves it alone
+		offset = pos - e->linepos;
+		if (e->length >= 0 && offset > e->length)
+			continue;
+
+		// Decoding a character looks at up to UTF8MAX bytes from its start
+		while (e->nrows > 0 && e->rows[e->nrows - 1].seen + UTF8MAX > offset)
+			e->nrows--;
+		e->wrapped = 0;
+
+		while (e->nmarks > 0 && e->marks[e->nmarks - 1].pos + UTF8MAX > offset)
+			e->nmarks--;
+		if (e->pos + UTF8MAX > offset)
+			e->pos = e->value = 0;
+		if (e->length >= 0) {
+			if (pos + len <= e->linepos + e->length
+					&& !memchr(buf, '\n', newlen) && !memchr(buf, '\r', newlen))
+				e->length += newlen - len;
+			else
+				e->length = -1;
+		}
+	}
+}
+
+int next_mark(struct colcache *e, int n) {
+	// Return how far n is from the offset of the next mark, or INT_MAX
+	// if it is already past it
+	int next = (e->nmarks + 1) * COLSTEP;
+
+	return n < next ? next - n : INT_MAX;
+}
+
+void add_column_mark(struct colcache *e, int n, int c) {
+	struct colmark *marks;
+	int size;
+
+	// Marks go at the first character boundary past each multiple of COLSTEP
+	if (n < (e->nmarks + 1) * COLSTEP || n >= (e->nmarks + 2) * COLSTEP)
+		return;
+	if (e->nmarks == e->maxmarks) {
+		size = e->maxmarks ? e->maxmarks * 2 : 16;
+		marks = (struct colmark *) realloc(e->marks, size * sizeof(struct colmark));
+		if (!marks)
+			return;
+		e->marks = marks;
+		e->maxmarks = size;
+	}
+	e->marks[e->nmarks].pos = n;
+	e->marks[e->nmarks].col = c;
+	e->nmarks++;
+}
+
+int column(struct editor *ed, int linepos, int col) {
+	struct colcache *e = find_columns(ed, linepos, 1);
+	unsigned char *p;
+	int i, n, c, len, inside = 1;
+
+	// Start from the last column computed or the nearest mark
+	i = col / COLSTEP;
+	if (i > e->nmarks)
+		i = e->nmarks;
+	while (i > 0 && e->marks[i - 1].pos > col)
+		i--;
+	n = i > 0 ? e->marks[i - 1].pos : 0;
+	if (e->pos <= col && e->pos >= n) {
+		n = e->pos;
+		c = e->value;
+	} else {
+		c = i > 0 ? e->marks[i - 1].col : 0;
+	}
+
+	p = text_ptr(ed, linepos + n);
+	while (n < col) {
+		if (p == ed->end)
+			break;
+		len = col - n;
+		if (inside && len > next_mark(e, n))
+			len = next_mark(e, n);
+		len = plain_text(ed, p, len);
+		if (len > 0) {
+			c += len;
+		} else {
+			if (*p == '\n' || *p == '\r')
+				inside = 0;
+			c += char_columns(ed, p, c, &len);
+		}
+		n += len;
+		p = skip_bytes(ed, p, len);
+		if (inside)
+			add_column_mark(e, n, c);
+	}
+
+	e->pos = n;
+	e->value = c;
+	return c;
+}
+
+int skip_columns(struct editor *ed, int linepos, int margin, int *col) {
+	// Find the first character in the line that is not entirely left of
+	// margin. Returns its offset and stores its column in col.
+	struct colcache *e;
+	unsigned char *p;
+	int lo, hi, mid, n, c, w, len;
+
+	*col = 0;
+	if (margin <= 0)
+		return 0;
+	e = find_columns(ed, linepos, 1);
+
+	// Find the last mark left of the margin
+	lo = 0;
+	hi = e->nmarks;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (e->marks[mid].col < margin)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	n = lo > 0 ? e->marks[lo - 1].pos : 0;
+	c = lo > 0 ? e->marks[lo - 1].col : 0;
+
+	p = text_ptr(ed, linepos + n);
+	while (c < margin) {
+		if (p == ed->end || *p == '\n' || *p == '\r')
+			break;
+		len = margin - c;
+		if (len > next_mark(e, n))
+			len = next_mark(e, n);
+		len = plain_text(ed, p, len);
+		if (len > 0) {
+			c += len;
+		} else {
+			w = char_columns(ed, p, c, &len);
+			if (c + w > margin)
+				break;
+			c += w;
+		}
+		n += len;
+		p = skip_bytes(ed, p, len);
+		add_column_mark(e, n, c);
+	}
+
+	*col = c;
+	return n;
+}
+
+int wrap_next(struct editor *ed, struct colcache *e) {
+	// Lay out the next row of the line. Rows break after the last blank
+	// that fits, or before the first character that does not fit.
+	// Returns -1 if the line has no more rows.
+	int width = ed->width;
+	unsigned char *p, *blank;
+	int start, seen, n, c, w, len, brk;
+	struct rowbreak *rows;
+
+	if (e->wrapped)
+		return -1;
+	start = e->nrows > 0 ? e->rows[e->nrows - 1].pos : 0;
+	p = text_ptr(ed, e->linepos + start);
+	n = start;
+	c = 0;
+	brk = -1;
+	for (;;) {
+		if (p == ed->end || *p == '\n' || *p == '\r') {
+			if (c < width || n == start) {
+				e->length = n;
+				e->wrapped = 1;
+				return -1;
+			}
+			seen = n;
+			break;
+		}
+		len = plain_text(ed, p, width - c);
+		if (len > 0) {
+			blank = memrchr(p, ' ', len);
+			if (blank)
+				brk = n + (blank - p) + 1;
+			c += len;
+		} else {
+			w = char_columns(ed, p, c, &len);
+			if (c + w > width && n > start) {
+				seen = n;
+				if (brk > start)
+					n = brk;
+				break;
+			}
+			c += w;
+			if (*p == '\t')
+				brk = n + 1;
+		}
+		n += len;
+		p = skip_bytes(ed, p, len);
+	}
+
+	if (e->nrows == e->maxrows) {
+		int size = e->maxrows ? e->maxrows * 2 : 16;
+		rows = (struct rowbreak *) realloc(e->rows, size * sizeof(struct rowbreak));
+		if (!rows)
+			return -1;
+		e->rows = rows;
+		e->maxrows = size;
+	}
+	e->rows[e->nrows].pos = n;
+	e->rows[e->nrows].seen = seen;
+	e->nrows++;
+	return 0;
+}
+
+struct colcache *wrap_layout(struct editor *ed, int linepos) {
+	int i;
+
+	if (ed->wrapcols != ed->width) {
+		for (i = 0; i < COLLINES; i++)
+			ed->cols[i].nrows = ed->cols[i].wrapped = 0;
+		ed->wrapcols = ed->width;
+	}
+	return find_columns(ed, linepos, 1);
+}
+
+int wrap_start(struct editor *ed, int linepos, int row) {
+	// Return the offset in the line where row starts, -1 if the line
+	// has fewer rows
+	struct colcache *e = wrap_layout(ed, linepos);
+
+	while (e->nrows < row && wrap_next(ed, e) == 0)
+		;
+	if (row == 0)
+		return 0;
+	return row <= e->nrows ? e->rows[row - 1].pos : -1;
+}
+
+int wrap_end(struct editor *ed, int linepos, int row) {
+	// Return the offset in the line where row ends
+	struct colcache *e = wrap_layout(ed, linepos);
+
+	while (e->nrows <= row && wrap_next(ed, e) == 0)
+		;
+	return row < e->nrows ? e->rows[row].pos : e->length;
+}
+
+int wrap_row(struct editor *ed, int linepos, int offset) {
+	// Return the row holding the character at offset
+	struct colcache *e = wrap_layout(ed, linepos);
+	int lo, hi, mid;
+
+	while ((e->nrows == 0 || e->rows[e->nrows - 1].pos <= offset) && wrap_next(ed, e) == 0)
+		;
+	lo = 0;
+	hi = e->nrows;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (e->rows[mid].pos <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int wrap_rows(struct editor *ed, int linepos) {
+	// Return the number of rows in the line
+	struct colcache *e = wrap_layout(ed, linepos);
+
+	while (wrap_next(ed, e) == 0)
+		;
+	return e->nrows + 1;
+}
+
+void install_file(struct editor *ed, struct load *load) {
+	strcpy(ed->filename, load->path);
+	ed->start = load->buf;
+	ed->gap = ed->start + load->loaded;
+	ed->rest = ed->end = ed->start + load->length + MINEXTEND;
+	ed->anchor = -1;
+	ed->syntax = find_syntax(ed->filename, ed->start, load->loaded);
+	clear_columns(ed);
+	set_filestat(ed, &load->statbuf);
+	watch_file(ed);
+}
+
+int sync_load(struct editor *ed) {
+	// Pick up the progress of a background load. Returns -1 if the
+	// file could not be loaded at all.
+	struct env *env = ed->env;
+	struct load *load = ed->load;
+	char name[FILENAME_MAX];
+	unsigned char *buf;
+	int loaded, state, pos;
+
+	pthread_mutex_lock(&env->lock);
+	buf = load->buf;
+	loaded = load->loaded;
+	state = load->state;
+	if (state == LOAD_DONE)
+		unlink_load(env, load);
+	pthread_mutex_unlock(&env->lock);
+
+	if (!ed->start) {
+		if (!buf) {
+			if (state != LOAD_DONE)
+				return 0;
+			ed->load = NULL;
+			errno = load->error;
+			free(load);
+			return -1;
+		}
+		install_file(ed, load);
+	}
+	if (ed->start + loaded > ed->gap) {
+		// The line that held the old end may have grown
+		pos = ed->gap - ed->start;
+		ed->gap = ed->start + loaded;
+		update_columns(ed, pos, 0, ed->start + pos, loaded - pos);
+	}
+
+	if (state == LOAD_DONE) {
+		// Partially loaded text must not be saved over the file
+		if (load->error)
+			ed->changed = 1;
+		reset_spans(ed);
+		if (sidecar_name(ed, name, "journal") == 0 && access(name, F_OK) == 0)
+			ed->recover = 1;
+		if (sidecar_name(ed, name, "undo") == 0 && access(name, F_OK) == 0)
+			ed->loadhistory = 1;
+		ed->load = NULL;
+		free(load);
+	}
+	return 0;
+}
+
+int await_load(struct editor *ed) {
+	// Wait until the first part of the file has been read
+	struct env *env = ed->env;
+	struct load *load = ed->load;
+
+	pthread_mutex_lock(&env->lock);
+	while (!load->buf && load->state != LOAD_DONE)
+		pthread_cond_wait(&env->loaded, &env->lock);
+	pthread_mutex_unlock(&env->lock);
+	return sync_load(ed);
+}
+
+int wait_load(struct editor *ed, int all) {
+	// Wait until more or all of the file has been read. Returns 1 if
+	// more text became available.
+	struct env *env = ed->env;
+	struct load *load = ed->load;
+	int len = text_length(ed);
+
+	if (!load)
+		return 0;
+	pthread_mutex_lock(&env->lock);
+	while (load->state != LOAD_DONE && (all || load->loaded == len))
+		pthread_cond_wait(&env->loaded, &env->lock);
+	pthread_mutex_unlock(&env->lock);
+	sync_load(ed);
+	if (text_length(ed) == len)
+		return 0;
+	ed->refresh = 1;
+	return 1;
+}
+
+int load_file(struct editor *ed, char *filename) {
+	if (queue_load(ed, filename, 1) < 0)
+		return -1;
+	return await_load(ed);
+}
+
+int write_text(struct editor *ed, int f, int pos, int end, int progress) {
+	struct iovec iov[2];
+	int gaplen = ed->gap - ed->start;
+	int n;
+
+	// Write both halves of the gap buffer with writev, in chunks large
+	// enough to keep the disk busy and small enough to report progress
+	while (pos < end) {
+		n = end - pos < SAVECHUNK ? end - pos : SAVECHUNK;
+		if (pos < gaplen) {
+			iov[0].iov_base = ed->start + pos;
+			iov[0].iov_len = gaplen - pos < n ? gaplen - pos : n;
+			iov[1].iov_base = ed->rest;
+			iov[1].iov_len = n - iov[0].iov_len;
+		} else {
+			iov[0].iov_base = ed->rest + pos - gaplen;
+			iov[0].iov_len = n;
+			iov[1].iov_len = 0;
+		}
+
+		n = writev(f, iov, iov[1].iov_len ? 2 : 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += n;
+		if (progress >= 0)
+			write(progress, &pos, sizeof(pos));
+	}
+	return 0;
+}
+
+int copy_text(struct editor *ed, int f, int src, int pos, struct span *span, int progress) {
+	// Let the file system share or copy the unchanged range of the
+	// original file without passing it through the buffer
+	struct file_clone_range clone;
+	loff_t off = span->orig;
+	ssize_t n;
+	int end = pos + span->len;
+
+	clone.src_fd = src;
+	clone.src_offset = span->orig;
+	clone.src_length = span->len;
+	clone.dest_offset = pos;
+	if (ioctl(f, FICLONERANGE, &clone) == 0 && lseek(f, end, SEEK_SET) == end) {
+		if (progress >= 0)
+			write(progress, &end, sizeof(end));
+		return 0;
+	}
+
+	while (pos < end) {
+		n = copy_file_range(src, &off, f, NULL, end - pos < SAVECHUNK ? end - pos : SAVECHUNK, 0);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			// Not supported here, write the rest from the buffer
+			break;
+		}
+		pos += n;
+		if (progress >= 0)
+			write(progress, &pos, sizeof(pos));
+	}
+	return write_text(ed, f, pos, end, progress);
+}
+
+int write_spans(struct editor *ed, int f, char *filename, int progress) {
+	struct stat statbuf;
+	struct span *span;
+	int pos, src, rc;
+
+	// Unchanged ranges can only be copied from the file they came from
+	src = ed->nspans < 0 ? -1 : open(filename, O_RDONLY | O_CLOEXEC);
+	if (src >= 0 && (fstat(src, &statbuf) < 0 || !same_file(&statbuf, &ed->filestat))) {
+		close(src);
+		src = -1;
+	}
+	if (src < 0)
+		return write_text(ed, f, 0, text_length(ed), progress);
+
+	rc = 0;
+	for (pos = 0, span = ed->spans; rc == 0 && span < ed->spans + ed->nspans; pos += span++->len) {
+		if (span->orig < 0)
+			rc = write_text(ed, f, pos, pos + span->len, progress);
+		else
+			rc = copy_text(ed, f, src, pos, span, progress);
+	}
+	close(src);
+	return rc;
+}
+
+int sync_dir(char *filename) {
+	char dirname[FILENAME_MAX];
+	char *slash;
+	int f, rc;
+
+	strcpy(dirname, filename);
+	slash = strrchr(dirname, '/');
+	if (slash == dirname)
+		slash[1] = 0;
+	else if (slash)
+		*slash = 0;
+	else
+		strcpy(dirname, ".");
+
+	f = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (f < 0)
+		return -1;
+	rc = fsync(f);
+	close(f);
+	return rc;
+}
+
+int save_in_place(struct editor *ed, char *filename, int progress) {
+	int f;
+
+	f = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	if (f < 0)
+		return -1;
+	if (write_text(ed, f, 0, text_length(ed), progress) < 0 || fsync(f) < 0) {
+		close(f);
+		return -1;
+	}
+	return close(f);
+}
+
+int write_changes(struct editor *ed, char *filename, int progress) {
+	// Write only the modified ranges when no unchanged text has moved
+	// since the file was loaded or saved. Returns 0 if the file has to
+	// be written in full instead.
+	struct stat statbuf;
+	struct span *span;
+	int length = text_length(ed);
+	int pos, done, n, f;
+
+	if (ed->nspans < 0)
+		return 0;
+	for (pos = 0, span = ed->spans; span < ed->spans + ed->nspans; pos += span++->len) {
+		if (span->orig >= 0 && span->orig != pos)
+			return 0;
+	}
+
+	// The file must still be the one the spans refer to
+	f = open(filename, O_WRONLY | O_CLOEXEC);
+	if (f < 0)
+		return 0;
+	if (fstat(f, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || !same_file(&statbuf, &ed->filestat)) {
+		close(f);
+		return 0;
+	}
+
+	for (pos = 0, span = ed->spans; span < ed->spans + ed->nspans; pos += span++->len) {
+		for (done = 0; span->orig < 0 && done < span->len; done += n) {
+			n = span->len - done < SAVECHUNK ? span->len - done : SAVECHUNK;
+			if (pos + done < ed->gap - ed->start && pos + done + n > ed->gap - ed->start)
+				n = ed->gap - ed->start - pos - done;
+			n = pwrite(f, text_ptr(ed, pos + done), n, pos + done);
+			if (n < 0) {
+				if (errno == EINTR) {
+					n = 0;
+					continue;
+				}
+				goto err;
+			}
+		}
+		if (progress >= 0) {
+			done = pos + span->len;
+			write(progress, &done, sizeof(done));
+		}
+	}
+	if (length != statbuf.st_size && ftruncate(f, length) < 0)
+		goto err;
+	if (fsync(f) < 0)
+		goto err;
+	close(f);
+	return 1;
+
+	err: close(f);
+	return -1;
+}
+
+int write_file(struct editor *ed, int progress) {
+	char filename[FILENAME_MAX];
+	char tmpname[FILENAME_MAX];
+	struct stat statbuf;
+	char *base;
+	mode_t mask;
+	int f, exists, rc;
+
+	// Replace the file itself, not a symbolic link pointing to it
+	if (!realpath(ed->filename, filename))
+		strcpy(filename, ed->filename);
+
+	// A few bytes changed in a large file are written in place
+	rc = write_changes(ed, filename, progress);
+	if (rc != 0)
+		return rc < 0 ? -1 : 0;
+	exists = stat(filename, &statbuf) == 0;
+
+	// Files with several hard links must keep their inode, so write those in place
+	if (exists && (!S_ISREG(statbuf.st_mode) || statbuf.st_nlink > 1))
+		return save_in_place(ed, filename, progress);
+
+	// Write the text to a temporary file next to the target and rename it
+	// over the target once it is safely on disk, so that a crash or a full
+	// disk never leaves a truncated file behind
+	base = strrchr(filename, '/');
+	base = base ? base + 1 : filename;
+	if (snprintf(tmpname, sizeof(tmpname), "%.*s.%s.XXXXXX", (int) (base - filename), filename, base) >= sizeof(tmpname))
+		return save_in_place(ed, filename, progress);
+	f = mkostemp(tmpname, O_CLOEXEC);
+	if (f < 0) {
+		// Directory not writable, fall back to overwriting the file
+		if (errno == EACCES || errno == EPERM || errno == EROFS)
+			return save_in_place(ed, filename, progress);
+		return -1;
+	}
+
+	if (exists) {
+		// Ownership can only be kept when permitted; keep going regardless
+		if (fchown(f, statbuf.st_uid, statbuf.st_gid) < 0)
+			fchown(f, -1, statbuf.st_gid);
+		fchmod(f, statbuf.st_mode & 07777);
+	} else {
+		mask = umask(0);
+		umask(mask);
+		fchmod(f, 0644 & ~mask);
+	}
+
+	if (write_spans(ed, f, filename, progress) < 0 || fsync(f) < 0)
+		goto err;
+	if (rename(tmpname, filename) < 0)
+		goto err;
+	close(f);
+	sync_dir(filename);
+	return 0;
+
+	err: close(f);
+	unlink(tmpname);
+	return -1;
+}
+
+int finish_save(struct editor *ed) {
+	char fn[FILENAME_MAX];
+	struct stat statbuf;
+
+	if (ed->saveerr) {
+		// Nothing was saved, the buffer still holds the only copy
+		errno = ed->saveerr;
+		ed->saveerr = 0;
+		ed->dirty = 1;
+		ed->nspans = -1;
+		ed->savelost = 1;
+		if (ed->journalfd >= 0 && ed->journalmark == 0) {
+			// Changes made during the save do not apply to the old file
+			close_journal(ed, 1);
+			ed->journalfd = JOURNAL_OFF;
+		}
+		watch_file(ed);
+		return -1;
+	}
+
+	if (realpath(ed->filename, fn) && strcmp(fn, ed->filename)) {
+		strcpy(ed->filename, fn);
+		register_editor(ed);
+	}
+	if (stat(ed->filename, &statbuf) == 0)
+		set_filestat(ed, &statbuf);
+	restart_journal(ed);
+	ed->changed = 0;
+	watch_file(ed);
+	return 0;
+}
+
+int read_save(struct editor *ed) {
+	int msg[64];
+	int status;
+	ssize_t n;
+	int i;
+
+	// Progress messages are written atomically, so reads never split them
+	while ((n = read(ed->savefd, msg, sizeof(msg))) > 0) {
+		for (i = 0; i < n / sizeof(int); i++) {
+			if (msg[i] < 0)
+				ed->saveerr = -msg[i];
+			else
+				ed->saved = msg[i];
+		}
+	}
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 1;
+
+	close(ed->savefd);
+	ed->savefd = -1;
+	if (waitpid(ed->savepid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		if (!ed->saveerr)
+			ed->saveerr = EIO;
+	}
+	ed->savepid = 0;
+	return 0;
+}
+
+int wait_save(struct editor *ed) {
+	struct pollfd pfd;
+
+	pfd.fd = ed->savefd;
+	pfd.events = POLLIN;
+	while (read_save(ed))
+		poll(&pfd, 1, -1);
+	return finish_save(ed);
+}
+
+int save_file(struct editor *ed) {
+	int fds[2];
+	int rc;
+
+	if (ed->savepid)
+		wait_save(ed);
+	if (ed->load)
+		wait_load(ed, 1);
+
+	// Our own writes and the rename must not look like outside changes
+	if (ed->watch >= 0) {
+		inotify_rm_watch(ed->env->notifyfd, ed->watch);
+		ed->watch = -1;
+	}
+
+	// A forked process gets a copy-on-write snapshot of the buffer and
+	// writes it out while editing continues
+	ed->savelen = text_length(ed);
+	ed->saved = 0;
+	ed->saveerr = 0;
+	ed->journalmark = ed->journalfd >= 0 ? ed->journalsize : 0;
+	if (pipe2(fds, O_CLOEXEC) == 0) {
+		ed->savepid = fork();
+		if (ed->savepid == 0) {
+			close(fds[0]);
+			signal(SIGPIPE, SIG_IGN);
+			rc = write_file(ed, fds[1]);
+			if (rc < 0) {
+				rc = -errno;
+				write(fds[1], &rc, sizeof(rc));
+			}
+			_exit(rc < 0);
+		}
+		close(fds[1]);
+		if (ed->savepid < 0) {
+			ed->savepid = 0;
+			close(fds[0]);
+		} else {
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+			ed->savefd = fds[0];
+		}
+	}
+
+	if (!ed->savepid) {
+		// Could not start a background save, save in the foreground
+		if (write_file(ed, -1) < 0)
+			ed->saveerr = errno;
+		if (finish_save(ed) < 0)
+			return -1;
+	}
+
+	// Further edits are relative to the text being saved
+	reset_spans(ed);
+	ed->dirty = 0;
+	ed->saveundo = ed->undo;
+	ed->savelost = 0;
+	return 0;
+}
+
+void move_gap(struct editor *ed, int pos, int minsize) {
+	int gapsize;
+	unsigned char *p;
+
+	// The loader is still filling in the gap
+	if (ed->load)
+		wait_load(ed, 1);
+
+	gapsize = ed->rest - ed->gap;
+	p = text_ptr(ed, pos);
+	if (minsize < 0)
+		minsize = 0;
+
+	if (minsize <= gapsize) {
+		if (p != ed->rest) {
+			if (p < ed->gap) {
+				memmove(p + gapsize, p, ed->gap - p);
+			} else {
+				memmove(ed->gap, ed->rest, p - ed->rest);
+			}
+			ed->gap = ed->start + pos;
+			ed->rest = ed->gap + gapsize;
+		}
+	} else {
+		int newsize;
+		unsigned char *start;
+		unsigned char *gap;
+		unsigned char *rest;
+		unsigned char *end;
+
+		if (gapsize + MINEXTEND > minsize)
+			minsize = gapsize + MINEXTEND;
+		newsize = (ed->end - ed->start) - gapsize + minsize;
+		start = (unsigned char *) malloc(newsize); // TODO check for out of memory
+		gap = start + pos;
+		rest = gap + minsize;
+		end = start + newsize;
+
+		if (p < ed->gap) {
+			memcpy(start, ed->start, pos);
+			memcpy(rest, p, ed->gap - p);
+			memcpy(end - (ed->end - ed->rest), ed->rest, ed->end - ed->rest);
+		} else {
+			memcpy(start, ed->start, ed->gap - ed->start);
+			memcpy(start + (ed->gap - ed->start), ed->rest, p - ed->rest);
+			memcpy(rest, p, ed->end - p);
+		}
+
+		free(ed->start);
+		ed->start = start;
+		ed->gap = gap;
+		ed->rest = rest;
+		ed->end = end;
+	}
+
+#ifdef DEBUG
+	memset(ed->gap, 0, ed->rest - ed->gap);
+#endif
+}
+
+void close_gap(struct editor *ed) {
+	int len = text_length(ed);
+	move_gap(ed, len, 1);
+	ed->start[len] = 0;
+}
+
+int get(struct editor *ed, int pos) {
+	unsigned char *p = text_ptr(ed, pos);
+	if (p >= ed->end)
+		return -1;
+	return *p;
+}
+
+int copy(struct editor *ed, unsigned char *buf, int pos, int len) {
+	unsigned char *bufptr = buf;
+	unsigned char *p = ed->start + pos;
+	if (p >= ed->gap)
+		p += (ed->rest - ed->gap);
+
+	while (len > 0) {
+		if (p == ed->end)
+			break;
+		*bufptr++ = *p;
+		len--;
+		if (++p == ed->gap)
+			p = ed->rest;
+	}
+
+	return bufptr - buf;
+}
+
+int count_newlines(unsigned char *p, int len) {
+	unsigned char *end = p + len;
+	int n = 0;
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		n++;
+		p++;
+	}
+	return n;
+}
+
+int count_lines(struct editor *ed, int pos, int len) {
+	int n = 0;
+	if (ed->start + pos < ed->gap) {
+		int seglen = ed->gap - (ed->start + pos);
+		if (seglen > len)
+			seglen = len;
+		n = count_newlines(ed->start + pos, seglen);
+		pos += seglen;
+		len -= seglen;
+	}
+	if (len > 0)
+		n += count_newlines(text_ptr(ed, pos), len);
+	return n;
+}
+
+int line_number(struct editor *ed, int pos) {
+	// Count the lines before pos from the cursor or the top of the screen,
+	// whichever is closer
+	int ref = ed->linepos, line = ed->line;
+
+	if (abs(ed->toppos - pos) < abs(ref - pos)) {
+		ref = ed->toppos;
+		line = ed->topline;
+	}
+	if (pos < abs(ref - pos))
+		return count_lines(ed, 0, pos);
+	if (pos >= ref)
+		return line + count_lines(ed, ref, pos - ref);
+	return line - count_lines(ed, pos, ref - pos);
+}
+
+//
+// Lexer state cache
+//
+// The state at the start of each line is kept in an array indexed by line.
+// An edit leaves the states up to its line good. The ones after it are
+// shifted by the lines inserted or removed and kept as stale, so lexing
+// from the edit can stop as soon as it produces a state that matches.
+//
+
+int grow_states(struct editor *ed, int n) {
+	int *states;
+	int maxstates;
+
+	if (n <= ed->maxstates)
+		return 0;
+	maxstates = ed->maxstates ? ed->maxstates * 2 : 1024;
+	while (maxstates < n)
+		maxstates *= 2;
+	states = realloc(ed->states, maxstates * sizeof(int));
+	if (!states)
+		return -1;
+	ed->states = states;
+	ed->maxstates = maxstates;
+	return 0;
+}
+
+int reset_states(struct editor *ed) {
+	// Start over from the default state at the top of the text
+	ed->nstates = ed->goodstates = 0;
+	if (grow_states(ed, 1) < 0)
+		return -1;
+	ed->states[0] = 0;
+	ed->nstates = ed->goodstates = 1;
+	ed->lexline = ed->lexpos = 0;
+	ed->syncline = -1;
+	return 0;
+}
+
+void update_states(struct editor *ed, int pos, int len, unsigned char *buf, int newlen) {
+	// Called before the text changes
+	int line, removed, added, tail;
+
+	ed->version++;
+	if (ed->nstates == 0) {
+		ed->lexline = ed->syncline = -1;
+		return;
+	}
+	line = line_number(ed, pos);
+	// The other known line start still holds if the change comes after it
+	if (line == ed->syncline && pos < ed->syncpos)
+		ed->syncpos = pos;
+	else if (pos < ed->syncpos)
+		ed->syncline = -1;
+
+	// States the background lexer finds for lines up to the changed one
+	// still hold
+	if (ed->lexjob && ed->lexjob->valid > line - ed->lexjob->line)
+		ed->lexjob->valid = line - ed->lexjob->line;
+
+	// Stale states from an earlier edit were lexed from other text.
+	// Lexing goes on from the line of the change, which does not move.
+	if (ed->nstates > ed->goodstates)
+		ed->syncline = -1;
+	ed->nstates = ed->goodstates;
+	if (line >= ed->goodstates - 1) {
+		if (line == ed->lexline && pos < ed->lexpos)
+			ed->lexpos = pos;
+		// Lines queued for the lexer are only good up to this one
+		if (ed->lexjob && ed->lexjob->valid == line - ed->lexjob->line) {
+			ed->syncline = line;
+			ed->syncpos = pos;
+		}
+		return;
+	}
+	ed->goodstates = line + 1;
+
+	removed = count_lines(ed, pos, len);
+	added = count_newlines(buf, newlen);
+	tail = ed->nstates - (line + 1 + removed);
+	if (tail > 0 && grow_states(ed, line + 1 + added + tail) == 0) {
+		memmove(ed->states + line + 1 + added, ed->states + line + 1 + removed, tail * sizeof(int));
+		memset(ed->states + line + 1, 0xFF, added * sizeof(int));
+		ed->nstates = line + 1 + added + tail;
+
+		// Remember where the last kept state is, lexing goes on from
+		// there once it catches up with the kept states
+		if (ed->lexline == ed->nstates - 1 - added + removed && pos + len < ed->lexpos) {
+			ed->syncline = ed->nstates - 1;
+			ed->syncpos = ed->lexpos + newlen - len;
+		}
+	} else {
+		ed->nstates = line + 1;
+	}
+	ed->lexline = line;
+	ed->lexpos = pos;
+}
+
+//
+// Other views
+//
+// The current view of a buffer is kept in the editor itself. Other views
+// of the same buffer are put aside, and their positions follow the
+// changes made through the current one.
+//
+
+void shift_line(struct editor *ed, int *linepos, int *line, int *col,
+		int pos, int len, unsigned char *buf, int newlen, int removed) {
+	// Keep a line start and its number, and a column in the line if col
+	// is not NULL, in step with a change. Called before the text changes.
+	// A position inside the replaced text ends up after the new text.
+	int x = *linepos + (col ? *col : 0);
+	unsigned char *nl;
+
+	if (x <= pos)
+		return;
+	if (x >= pos + len) {
+		*line += count_newlines(buf, newlen) - removed;
+		x += newlen - len;
+	} else {
+		*line += count_newlines(buf, newlen) - count_lines(ed, pos, x - pos);
+		x = pos + newlen;
+	}
+
+	if (*linepos > pos + len) {
+		*linepos += newlen - len;
+	} else {
+		// The newline before the line was replaced
+		nl = memrchr(buf, '\n', newlen);
+		if (nl) {
+			*linepos = pos + (nl - buf) + 1;
+		} else {
+			for (*linepos = pos; *linepos > 0 && get(ed, *linepos - 1) != '\n'; (*linepos)--)
+				;
+		}
+	}
+	if (col)
+		*col = x - *linepos;
+}
+
+void update_views(struct editor *ed, int pos, int len, unsigned char *buf, int newlen) {
+	// Called before the text changes
+	struct view *v;
+	int removed, i;
+
+	if (ed->nviews < 2)
+		return;
+	removed = count_lines(ed, pos, len);
+	for (i = 0; i < ed->nviews; i++) {
+		if (i == ed->curview)
+			continue;
+		v = &ed->views[i];
+		shift_line(ed, &v->toppos, &v->topline, NULL, pos, len, buf, newlen, removed);
+		shift_line(ed, &v->linepos, &v->line, &v->col, pos, len, buf, newlen, removed);
+		v->lastcol = v->col;
+		if (v->anchor > pos)
+			v->anchor = v->anchor >= pos + len ? v->anchor + newlen - len : pos;
+	}
+}
+
+//
+// Persistent undo
+//
+// The undo history of a file is kept in a file next to it when the
+// editor is closed, together with the identity and a hash of the saved
+// text, and read back the first time the history is needed after the
+// file is opened again.
+//
+
+unsigned long long hash_text(struct editor *ed) {
+	unsigned long long h = 14695981039346656037ULL;
+	unsigned long long w;
+	unsigned char *p, *end;
+
+	close_gap(ed);
+	p = ed->start;
+	end = ed->gap;
+	for (; p + 8 <= end; p += 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 1099511628211ULL;
+	}
+	for (; p < end; p++)
+		h = (h ^ *p) * 1099511628211ULL;
+	return h;
+}
+
+void history_header(struct editor *ed, struct history *header) {
+	memset(header, 0, sizeof(struct history));
+	memcpy(header->magic, HISTORY_MAGIC, sizeof(header->magic));
+	header->dev = ed->filestat.st_dev;
+	header->ino = ed->filestat.st_ino;
+	header->size = ed->filestat.st_size;
+	header->mtime = ed->filestat.st_mtim.tv_sec;
+	header->mtimensec = ed->filestat.st_mtim.tv_nsec;
+}
+
+void save_history(struct editor *ed) {
+	char name[FILENAME_MAX];
+	char tmpname[FILENAME_MAX];
+	struct history header;
+	struct record rec;
+	struct branch branch;
+	struct undo *undo;
+	unsigned char *undobuf, *redobuf;
+	FILE *f;
+	int fd, ok;
+
+	// History that was never read back is still on disk
+	if (ed->loadhistory || ed->load || sidecar_name(ed, name, "undo") < 0)
+		return;
+	if (!ed->undohead || ed->savelost) {
+		unlink(name);
+		return;
+	}
+
+	history_header(ed, &header);
+	if (!ed->dirty)
+		header.hash = hash_text(ed);
+	header.count = ed->undotail->seq;
+	header.current = ed->saveundo ? ed->saveundo->seq : 0;
+
+	if (snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", name) >= sizeof(tmpname))
+		return;
+	fd = mkostemp(tmpname, O_CLOEXEC);
+	if (fd < 0)
+		return;
+	f = fdopen(fd, "wb");
+	ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	for (undo = ed->undohead; ok && undo; undo = undo->next) {
+		seal_undo(undo);
+		rec.pos = undo->pos;
+		rec.erased = undo->erased;
+		rec.inserted = undo->inserted;
+		branch.parent = undo->prev ? undo->prev->seq : 0;
+		undobuf = undo_text(ed, undo, 0);
+		redobuf = undo_text(ed, undo, 1);
+		ok = (undobuf || !undo->erased) && (redobuf || !undo->inserted)
+				&& fwrite(&rec, sizeof(rec), 1, f) == 1
+				&& fwrite(&branch, sizeof(branch), 1, f) == 1
+				&& fwrite(undobuf, 1, undo->erased, f) == undo->erased
+				&& fwrite(redobuf, 1, undo->inserted, f) == undo->inserted;
+		if (undobuf != undo->undobuf)
+			free(undobuf);
+		if (redobuf != undo->redobuf)
+			free(redobuf);
+	}
+	if (fflush(f) != 0 || fsync(fd) < 0)
+		ok = 0;
+	fclose(f);
+	if (!ok || rename(tmpname, name) < 0)
+		unlink(tmpname);
+}
+
+void load_history(struct editor *ed) {
+	char name[FILENAME_MAX];
+	struct history header, expect;
+	struct record rec;
+	struct branch branch;
+	struct undo **records;
+	struct undo *undo;
+	long long *sizes, root, size;
+	int length = text_length(ed);
+	FILE *f;
+	int i, ok;
+
+	ed->loadhistory = 0;
+	if (ed->undohead || sidecar_name(ed, name, "undo") < 0)
+		return;
+	f = fopen(name, "rb");
+	if (!f)
+		return;
+
+	// The history must belong to the text as it is now
+	history_header(ed, &expect);
+	if (fread(&header, sizeof(header), 1, f) != 1
+			|| memcmp(header.magic, expect.magic, sizeof(header.magic)) != 0
+			|| header.size != length) {
+		fclose(f);
+		return;
+	}
+	if ((header.dev != expect.dev || header.ino != expect.ino
+			|| header.mtime != expect.mtime || header.mtimensec != expect.mtimensec)
+			&& (!header.hash || header.hash != hash_text(ed))) {
+		fclose(f);
+		return;
+	}
+
+	if (header.count <= 0 || header.current < 0 || header.current > header.count) {
+		fclose(f);
+		return;
+	}
+	records = (struct undo **) malloc((header.count + 1) * sizeof(struct undo *));
+	sizes = (long long *) malloc((header.count + 1) * sizeof(long long));
+	if (!records || !sizes) {
+		free(records);
+		free(sizes);
+		fclose(f);
+		return;
+	}
+
+	// Records are stored oldest first, so parents come before their children.
+	// The size of the text after each one is kept relative to the root.
+	records[0] = NULL;
+	sizes[0] = 0;
+	for (i = 1, ok = 1; ok && i <= header.count; i++) {
+		if (fread(&rec, sizeof(rec), 1, f) != 1 || fread(&branch, sizeof(branch), 1, f) != 1
+				|| rec.erased < 0 || rec.inserted < 0
+				|| branch.parent < 0 || branch.parent >= i) {
+			ok = 0;
+			break;
+		}
+		undo = records[i] = add_undo(ed, records[branch.parent]);
+		if (!undo) {
+			ok = 0;
+			break;
+		}
+		undo->pos = rec.pos;
+		undo->erased = rec.erased;
+		undo->inserted = rec.inserted;
+		sizes[i] = sizes[branch.parent] + rec.inserted - rec.erased;
+		undo->undobuf = rec.erased ? undo_alloc(ed, rec.erased, 0) : NULL;
+		undo->redobuf = rec.inserted ? undo_alloc(ed, rec.inserted, 0) : NULL;
+
+		ok = (undo->undobuf || !rec.erased) && (undo->redobuf || !rec.inserted)
+				&& fread(undo->undobuf, 1, rec.erased, f) == rec.erased
+				&& fread(undo->redobuf, 1, rec.inserted, f) == rec.inserted;
+		// Old history is only dropped once the records are all in
+		limit_memory(ed);
+	}
+	fclose(f);
+
+	// Undo and redo replace text at the recorded positions, so each record
+	// has to fit in the text it changes. The current state gives the size
+	// of the root.
+	if (ok) {
+		root = length - sizes[header.current];
+		for (i = 1; ok && i <= header.count; i++) {
+			undo = records[i];
+			size = root + (undo->prev ? sizes[undo->prev->seq] : 0);
+			if (undo->pos < 0 || undo->pos > size || undo->erased > size - undo->pos)
+				ok = 0;
+		}
+	}
+	free(sizes);
+
+	if (!ok) {
+		free(records);
+		clear_undo(ed);
+		return;
+	}
+
+	// Changes discarded when the file was closed can be redone
+	ed->undo = ed->saveundo = records[header.current];
+	ed->savelost = 0;
+	free(records);
+	limit_undo(ed);
+}
+
+int record_undo(struct editor *ed, int pos, int len, unsigned char *buf, int bufsize) {
+	// Add a change to the undo history, returns -1 if out of memory
+	struct undo *undo;
+
+	if (ed->loadhistory)
+		load_history(ed);
+	undo = ed->undo;
+	if (undo && (undo != ed->undotail || undo->spill >= 0 || undo == ed->saveundo))
+		undo = NULL; // Only the newest undo buffer can grow
+	if (undo && len == 0 && bufsize == 1 && undo->erased == 0
+			&& pos == undo->pos + undo->inserted) {
+		// Insert character at end of current redo buffer
+		undo->redobuf = undo_extend(ed, undo->redobuf, undo->inserted, 1);
+		if (!undo->redobuf)
+			return -1;
+		undo->redobuf[undo->inserted] = *buf;
+		undo->inserted++;
+	} else if (undo && len == 1 && bufsize == 0 && undo->inserted == 0
+			&& pos == undo->pos && !undo->reversed) {
+		// Erase character at end of current undo buffer
+		undo->undobuf = undo_extend(ed, undo->undobuf, undo->erased, 1);
+		if (!undo->undobuf)
+			return -1;
+		undo->undobuf[undo->erased] = get(ed, pos);
+		undo->erased++;
+	} else if (undo && len == 1 && bufsize == 0 && undo->inserted == 0
+			&& pos == undo->pos - 1 && (undo->reversed || undo->erased == 1)) {
+		// Erase character at beginning of current undo buffer
+		undo->pos--;
+		undo->undobuf = undo_extend(ed, undo->undobuf, undo->erased, 1);
+		if (!undo->undobuf)
+			return -1;
+		undo->undobuf[undo->erased] = get(ed, pos);
+		undo->erased++;
+		undo->reversed = 1;
+	} else {
+		// Create new undo buffer, branching off if the current state
+		// was reached by undo
+		if (ed->undotail)
+			seal_undo(ed->undotail);
+		undo = ed->undo;
+		if (undo && undo->checkpoint < 0
+				&& undo->replay + replay_cost(undo) >= (long long) text_length(ed) + CHECKPOINTMIN)
+			checkpoint_undo(ed, undo);
+		undo = add_undo(ed, ed->undo);
+		if (!undo)
+			return -1;
+		ed->undo = undo;
+
+		undo->pos = pos;
+		undo->erased = len;
+		undo->inserted = bufsize;
+		if (len > 0) {
+			undo->undobuf = undo_alloc(ed, len, 0);
+			if (!undo->undobuf)
+				return -1;
+			copy(ed, undo->undobuf, pos, len);
+		}
+		if (bufsize > 0) {
+			undo->redobuf = undo_alloc(ed, bufsize, 0);
+			if (!undo->redobuf)
+				return -1;
+			memcpy(undo->redobuf, buf, bufsize);
+		}
+	}
+	limit_undo(ed);
+	return 0;
+}
+
+void replace(struct editor *ed, int pos, int len, unsigned char *buf,
+		int bufsize, int doundo) {
+	unsigned char *p;
+
+	if (ed->load)
+		wait_load(ed, 1);
+	p = ed->start + pos;
+
+	// Store undo information. Without it the history no longer leads to
+	// the text, so it is started over.
+	if (doundo && record_undo(ed, pos, len, buf, bufsize) < 0) {
+		clear_undo(ed);
+		ed->savelost = 1;
+	}
+
+	// Lines are counted in the text before the change
+	update_states(ed, pos, len, buf, bufsize);
+	update_views(ed, pos, len, buf, bufsize);
+	update_marks(ed, pos, len, bufsize);
+	if (ed->lastedit)
+		set_mark(ed, ed->lastedit, pos + bufsize);
+	else
+		ed->lastedit = add_mark(ed, pos + bufsize);
+
+	if (bufsize == 0 && p <= ed->gap && p + len >= ed->gap) {
+		// Handle deletions at the edges of the gap
+		ed->rest += len - (ed->gap - p);
+		ed->gap = p;
+	} else {
+		// Move the gap
+		move_gap(ed, pos + len, bufsize - len);
+
+		// Replace contents
+		memcpy(ed->start + pos, buf, bufsize);
+		ed->gap = ed->start + pos + bufsize;
+	}
+
+	// Mark buffer as dirty
+	update_spans(ed, pos, len, bufsize);
+	update_columns(ed, pos, len, buf, bufsize);
+	journal_replace(ed, pos, len, buf, bufsize);
+	ed->dirty = 1;
+}
+
+int append_file(struct editor *ed, int fd) {
+	// Read everything from fd straight into the gap at the end of the
+	// buffer without recording undo information. The buffer is grown
+	// geometrically so large inputs are not copied over and over.
+	int pos = text_length(ed);
+	ssize_t n;
+
+	move_gap(ed, pos, 0);
+	for (;;) {
+		if (ed->rest - ed->gap < MINEXTEND) {
+			size_t size = ed->end - ed->start;
+			size_t newsize = size * 2;
+			unsigned char *start;
+
+			if (newsize < size + READCHUNK)
+				newsize = size + READCHUNK;
+			if (newsize > INT_MAX)
+				newsize = INT_MAX;
+			if (newsize <= size) {
+				errno = EFBIG;
+				n = -1;
+				break;
+			}
+			start = (unsigned char *) realloc(ed->start, newsize);
+			if (!start) {
+				n = -1;
+				break;
+			}
+			ed->gap = start + (ed->gap - ed->start);
+			ed->start = start;
+			ed->rest = ed->end = start + newsize;
+		}
+
+		n = read(fd, ed->gap, ed->rest - ed->gap);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		ed->gap += n;
+	}
+
+	// The line that held the old end may have grown
+	if (ed->start + pos < ed->gap)
+		update_columns(ed, pos, 0, ed->start + pos, ed->gap - ed->start - pos);
+	return n;
+}
+
+void insert(struct editor *ed, int pos, unsigned char *buf, int bufsize) {
+	replace(ed, pos, 0, buf, bufsize, 1);
+}
+
+void erase_section(struct editor *ed, int pos, int len) {
+	replace(ed, pos, len, NULL, 0, 1);
+}
+
+//
+// Navigation functions
+//
+
+int line_length(struct editor *ed, int linepos) {
+	struct colcache *e = find_columns(ed, linepos, 0);
+	int pos = linepos;
+
+	if (e && e->length >= 0)
+		return e->length;
+	while (1) {
+		int ch = get(ed, pos);
+		if (ch < 0 || ch == '\n' || ch == '\r')
+			break;
+		pos++;
+	}
+
+	if (e)
+		e->length = pos - linepos;
+	return pos - linepos;
+}
+
+int line_start(struct editor *ed, int pos) {
+	while (1) {
+		if (pos == 0)
+			break;
+		if (get(ed, pos - 1) == '\n')
+			break;
+		pos--;
+	}
+
+	return pos;
+}
+
+int next_line(struct editor *ed, int pos) {
+	struct colcache *e = find_columns(ed, pos, 0);
+	int before = ed->gap - ed->start;
+	int len = text_length(ed);
+	unsigned char *p;
+
+	if (pos < 0 || pos >= len)
+		return -1;
+	if (e && e->length >= 0)
+		pos += e->length;
+
+	if (pos < before) {
+		p = memchr(ed->start + pos, '\n', before - pos);
+		if (p)
+			return p - ed->start + 1;
+		pos = before;
+	}
+	p = memchr(ed->rest + (pos - before), '\n', len - pos);
+	return p ? p - ed->rest + before + 1 : -1;
+}
+
+int prev_line(struct editor *ed, int pos) {
+	if (pos == 0)
+		return -1;
+
+	while (pos > 0) {
+		int ch = get(ed, --pos);
+		if (ch == '\n')
+			break;
+	}
+
+	while (pos > 0) {
+		int ch = get(ed, --pos);
+		if (ch == '\n')
+			return pos + 1;
+	}
+
+	return 0;
+}
+
+
+void moveto(struct editor *ed, int pos, int center) {
+	int scroll = 0;
+	for (;;) {
+		int cur = ed->linepos + ed->col;
+		if (pos < cur) {
+			if (pos >= ed->linepos) {
+				ed->col = pos - ed->linepos;
+			} else {
+				ed->col = 0;
+				ed->linepos = prev_line(ed, ed->linepos);
+				ed->line--;
+
+				if (ed->topline > ed->line) {
+					ed->toppos = ed->linepos;
+					ed->topline--;
+					ed->refresh = 1;
+					scroll = 1;
+				}
+			}
+		} else if (pos > cur) {
+			int next = next_line(ed, ed->linepos);
+			if (next == -1) {
+				ed->col = text_length(ed) - ed->linepos;
+				break;
+			} else if (pos < next) {
+				ed->col = pos - ed->linepos;
+			} else {
+				ed->col = 0;
+				ed->linepos = next;
+				ed->line++;
+
+				if (ed->line >= ed->topline + ed->height) {
+					ed->toppos = next_line(ed, ed->toppos);
+					ed->topline++;
+					ed->refresh = 1;
+					scroll = 1;
+				}
+			}
+		} else {
+			break;
+		}
+	}
+
+	if (scroll && center) {
+		int tl = ed->line - ed->height / 2;
+		if (tl < 0)
+			tl = 0;
+		for (;;) {
+			if (ed->topline > tl) {
+				ed->toppos = prev_line(ed, ed->toppos);
+				ed->topline--;
+			} else if (ed->topline < tl) {
+				ed->toppos = next_line(ed, ed->toppos);
+				ed->topline++;
+			} else {
+				break;
+			}
+		}
+	}
+}
+
+//
+// Text selection
+//
+
+int get_selection(struct editor *ed, int *start, int *end) {
+	if (ed->anchor == -1) {
+		*start = *end = -1;
+		return 0;
+	} else {
+		int pos = ed->linepos + ed->col;
+		if (pos == ed->anchor) {
+			*start = *end = -1;
+			return 0;
+		} else if (pos < ed->anchor) {
+			*start = pos;
+			*end = ed->anchor;
+		} else {
+			*start = ed->anchor;
+			*end = pos;
+		}
+	}
+	return 1;
+}
+
+int get_selected_text(struct editor *ed, char *buffer, int size) {
+	int selstart, selend, len;
+
+	if (!get_selection(ed, &selstart, &selend))
+		return 0;
+	len = selend - selstart;
+	if (len >= size)
+		return 0;
+	copy(ed, buffer, selstart, len);
+	buffer[len] = 0;
+	return len;
+}
+
+void update_selection(struct editor *ed, int select) {
+	if (select) {
+		if (ed->anchor == -1)
+			ed->anchor = ed->linepos + ed->col;
+		ed->refresh = 1;
+	} else {
+		if (ed->anchor != -1)
+			ed->refresh = 1;
+		ed->anchor = -1;
+	}
+}
+
+int erase_selection(struct editor *ed) {
+	int selstart, selend;
+
+	if (!get_selection(ed, &selstart, &selend))
+		return 0;
+	moveto(ed, selstart, 0);
+	erase_section(ed, selstart, selend - selstart);
+	ed->anchor = -1;
+	ed->refresh = 1;
+	return 1;
+}
+
+void select_all(struct editor *ed) {
+	wait_load(ed, 1);
+	ed->anchor = 0;
+	ed->refresh = 1;
+	moveto(ed, text_length(ed), 0);
+}
+
+//
+// Screen functions
+//
+
+void get_console_size(struct env *env) {
+	struct winsize ws;
+
+	ioctl(0, TIOCGWINSZ, &ws);
+	env->cols = ws.ws_col;
+	env->lines = ws.ws_row - 1;
+
+	env->linebuf = realloc(env->linebuf, env->cols * UTF8MAX + LINEBUF_EXTRA * 2);
+}
+
+void outch(char c) {
+	putchar(c);
+}
+
+void outbuf(char *buf, int len) {
+	fwrite(buf, 1, len, stdout);
+}
+
+void outstr(char *str) {
+	fputs(str, stdout);
+}
+
+void clear_screen() {
+	outstr(CLRSCR);
+}
+
+void gotoxy(int col, int line) {
+	char buf[32];
+
+	sprintf(buf, GOTOXY, line + 1, col + 1);
+	outstr(buf);
+}
+
+int prompt(struct editor *ed, char *msg, int selection) {
+	int maxlen, len, ch;
+	char *buf = ed->env->linebuf;
+
+	gotoxy(0, ed->env->lines);
+	outstr(STATUS_COLOR);
+	outstr(msg);
+	outstr(CLREOL);
+
+	len = 0;
+	maxlen = ed->env->cols - strlen(msg) - 1;
+	if (selection)
+		len = get_selected_text(ed, buf, maxlen);
+	outbuf(buf, len);
+
+	for (;;) {
+		fflush(stdout);
+		ch = getkey();
+		if (ch == KEY_ESC) {
+			return 0;
+		} else if (ch == KEY_ENTER) {
+			buf[len] = 0;
+			return len > 0;
+		} else if (ch == KEY_BACKSPACE) {
+			if (len > 0) {
+				outstr("\b \b");
+				while (len > 1 && (buf[len - 1] & 0xC0) == 0x80)
+					len--;
+				len--;
+			}
+		} else if (ch >= ' ' && ch < 0x100 && len < maxlen) {
+			outch(ch);
+			buf[len++] = ch;
+		}
+	}
+}
+
+int ask() {
+	int ch = getchar();
+	return ch == 'y' || ch == 'Y';
+}
+
+//
+// Syntax highlighting
+//
+
+void set_syntax(struct editor *ed, unsigned char *text, int len) {
+	ed->syntax = find_syntax(ed->filename, text, len);
+	ed->nstates = ed->goodstates = 0;
+	if (ed->lexjob)
+		ed->lexjob->valid = 0;
+}
+
+unsigned char *line_text(struct editor *ed, int linepos, int len) {
+	// Return the text of a line in one piece, copying it out if it
+	// spans the gap
+	struct env *env = ed->env;
+	unsigned char *p = text_ptr(ed, linepos);
+
+	if (p >= ed->gap || p + len <= ed->gap)
+		return p;
+	if (!env->syntaxbuf) {
+		env->syntaxbuf = (unsigned char *) malloc(SYNTAXLINE);
+		if (!env->syntaxbuf)
+			return NULL;
+	}
+	copy(ed, env->syntaxbuf, linepos, len);
+	return env->syntaxbuf;
+}
+
+int lex_line(struct editor *ed, int linepos, int state, unsigned char *attrs, int *next) {
+	// Lex a line starting in state and store where the next line starts.
+	// Returns the state at the start of the next line, or -1 if the line
+	// is too long to highlight.
+	unsigned char *text;
+	int len;
+
+	*next = next_line(ed, linepos);
+	len = (*next < 0 ? text_length(ed) : *next - 1) - linepos;
+	if (len > 0 && get(ed, linepos + len - 1) == '\r')
+		len--;
+	if (len > SYNTAXLINE)
+		return -1;
+	text = line_text(ed, linepos, len);
+	if (!text)
+		return -1;
+	return highlight(ed->syntax, state, text, len, attrs);
+}
+
+void store_state(struct editor *ed, int line, int state) {
+	// Record the state at the start of the line after the good ones.
+	// Once it matches the state kept from before the last edit, the
+	// states after it are good again.
+	if (line != ed->goodstates)
+		return;
+	if (line < ed->nstates) {
+		if (ed->states[line] == state) {
+			ed->goodstates = ed->nstates;
+			if (ed->syncline == ed->goodstates - 1) {
+				ed->lexline = ed->syncline;
+				ed->lexpos = ed->syncpos;
+			}
+			return;
+		}
+	} else {
+		if (grow_states(ed, line + 1) < 0)
+			return;
+		ed->nstates = line + 1;
+	}
+	ed->states[line] = state;
+	ed->goodstates = line + 1;
+}
+
+void *lex_worker(void *arg) {
+	struct env *env = (struct env *) arg;
+	struct lexjob *job;
+	unsigned char *text;
+	int i, state;
+
+	pthread_mutex_lock(&env->lock);
+	while (!env->stop) {
+		job = env->lexjobs;
+		while (job && job->done)
+			job = job->next;
+		if (!job) {
+			pthread_cond_wait(&env->lexqueued, &env->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&env->lock);
+
+		// Lines too long to highlight leave the state as it was
+		text = job->text;
+		state = job->state;
+		for (i = 0; i < job->lines; i++) {
+			if (job->states[i] >= 0) {
+				state = highlight(job->syntax, state, text, job->states[i], NULL);
+				text += job->states[i];
+			}
+			job->states[i] = state;
+		}
+
+		pthread_mutex_lock(&env->lock);
+		job->done = 1;
+		write(env->wakefd[1], "", 1);
+	}
+	pthread_mutex_unlock(&env->lock);
+	return NULL;
+}
+
+int queue_lex(struct editor *ed, int target, int targetpos) {
+	// Copy the lines from the last good state towards the target line
+	// and queue them for the background lexer. Returns -1 if the lexer
+	// cannot be used.
+	struct env *env = ed->env;
+	struct lexjob *job, **q;
+	int line = ed->goodstates - 1;
+	int pos, next, len, size, maxlines, n;
+	unsigned char *p;
+	int *states;
+
+	if (ed->lexjob)
+		return 0;
+	if (!env->lexing) {
+		start_threads(env);
+		if (pthread_create(&env->lexer, NULL, lex_worker, env) != 0)
+			return -1;
+		env->lexing = 1;
+	}
+
+	// Find the first line from the nearest known line start. After an
+	// edit lexing goes on from its line, or from the last state kept
+	// from before it once the states match again.
+	if (ed->lexline == line) {
+		pos = line_start(ed, ed->lexpos);
+	} else if (ed->syncline == line) {
+		pos = line_start(ed, ed->syncpos);
+	} else if (line < target - line) {
+		for (pos = 0, len = 0; len < line; len++)
+			pos = next_line(ed, pos);
+	} else {
+		for (pos = targetpos, len = target; len > line; len--)
+			pos = prev_line(ed, pos);
+	}
+
+	job = (struct lexjob *) calloc(1, sizeof(struct lexjob));
+	if (!job)
+		return -1;
+	job->text = (unsigned char *) malloc(SYNTAXCHUNK + SYNTAXLINE);
+	maxlines = 1024;
+	job->states = (int *) malloc(maxlines * sizeof(int));
+	if (!job->text || !job->states) {
+		free(job->text);
+		free(job->states);
+		free(job);
+		return -1;
+	}
+	job->ed = ed;
+	job->syntax = ed->syntax;
+	job->version = ed->version;
+	job->line = line;
+	job->state = ed->states[line];
+	job->target = target;
+	job->targetpos = targetpos;
+
+	// Copy whole lines until the chunk is full
+	for (size = 0; line < target && size < SYNTAXCHUNK; line++) {
+		if (job->lines == maxlines) {
+			states = (int *) realloc(job->states, maxlines * 2 * sizeof(int));
+			if (!states)
+				break;
+			job->states = states;
+			maxlines *= 2;
+		}
+		next = next_line(ed, pos);
+		len = next - 1 - pos;
+		if (len > 0 && get(ed, next - 2) == '\r')
+			len--;
+		if (len > SYNTAXLINE) {
+			len = -1;
+		} else {
+			// Copy the line in one or two pieces around the gap
+			p = text_ptr(ed, pos);
+			n = p < ed->gap && p + len > ed->gap ? ed->gap - p : len;
+			memcpy(job->text + size, p, n);
+			if (n < len)
+				memcpy(job->text + size + n, ed->rest, len - n);
+			size += len;
+		}
+		job->states[job->lines++] = len;
+		pos = next;
+	}
+	job->endpos = pos;
+	job->valid = job->lines;
+
+	pthread_mutex_lock(&env->lock);
+	for (q = &env->lexjobs; *q; q = &(*q)->next)
+		;
+	*q = job;
+	pthread_cond_signal(&env->lexqueued);
+	pthread_mutex_unlock(&env->lock);
+	ed->lexjob = job;
+	return 0;
+}
+
+int line_state(struct editor *ed, int line, int linepos) {
+	// Return the lexer state at the start of a line, lexing forward from
+	// the last good state. Lines too far past it are handed to the
+	// background lexer, and -1 is returned until it is done with them.
+	int pos, next, state, first, n, i;
+
+	if (!ed->syntax)
+		return 0;
+	if (ed->goodstates == 0 && reset_states(ed) < 0)
+		return 0;
+	if (line < ed->goodstates)
+		return ed->states[line];
+
+	first = ed->goodstates - 1;
+	if (line - first > SYNTAXSYNC && queue_lex(ed, line, linepos) == 0)
+		return -1;
+	for (pos = linepos, i = line; i > first; i--)
+		pos = prev_line(ed, pos);
+	state = ed->states[first];
+
+	for (i = first; i < line; i++) {
+		n = lex_line(ed, pos, state, NULL, &next);
+		if (n >= 0)
+			state = n;
+		store_state(ed, i + 1, state);
+		pos = next;
+		if (ed->goodstates == i + 2) {
+			ed->lexline = i + 1;
+			ed->lexpos = pos;
+		}
+		if (line < ed->goodstates)
+			return ed->states[line];
+	}
+	return state;
+}
+
+unsigned char *syntax_line(struct editor *ed, int linepos, int line, int *state) {
+	// Lex a line for display. Takes the state at its start and leaves
+	// the state at the start of the next line. Returns the highlight
+	// class of each byte, or NULL to show the line as plain text.
+	struct env *env = ed->env;
+	int next, n;
+
+	if (!ed->syntax || *state < 0)
+		return NULL;
+	if (!env->attrs) {
+		env->attrs = (unsigned char *) malloc(SYNTAXLINE);
+		if (!env->attrs)
+			return NULL;
+	}
+	n = lex_line(ed, linepos, *state, env->attrs, &next);
+	if (n < 0)
+		return NULL;
+	*state = n;
+	if (next >= 0)
+		store_state(ed, line + 1, n);
+	return env->attrs;
+}
+
+//
+// Display functions
+//
+
+void display_message(struct editor *ed, char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	gotoxy(0, ed->env->lines);
+	outstr(STATUS_COLOR);
+	vprintf(fmt, args);
+	outstr(CLREOL TEXT_COLOR);
+	fflush(stdout);
+	va_end(args);
+}
+
+void draw_full_statusline(struct editor *ed) {
+	struct env *env = ed->env;
+	char mode[32] = "";
+	int namewidth;
+
+	if (ed->load && ed->start && ed->load->length > 0) {
+		sprintf(mode, " [Loading %d%%]",
+				(int) (text_length(ed) * 100LL / ed->load->length));
+	} else if (ed->load) {
+		strcpy(mode, " [Loading]");
+	} else if (ed->savepid && ed->savelen > 0) {
+		sprintf(mode, " [Saving %d%%]",
+				(int) (ed->saved * 100LL / ed->savelen));
+	} else if (ed->follow) {
+		strcpy(mode, " [Follow]");
+	} else if (ed->changed) {
+		strcpy(mode, " [Changed]");
+	}
+	namewidth = env->cols - 19 - strlen(mode);
+
+	gotoxy(0, env->lines);
+	sprintf(env->linebuf,
+			STATUS_COLOR "%*.*s%s%c Ln %-6dCol %-4d" CLREOL TEXT_COLOR,
+			-namewidth, namewidth, ed->filename, mode, ed->dirty ? '*' : ' ',
+			ed->line + 1, column(ed, ed->linepos, ed->col) + 1);
+	outstr(env->linebuf);
+#ifdef DEBUG
+	gotoxy(0, env->lines - 1);
+	sprintf(env->linebuf,
+			STATUS_COLOR "[%02X%02X%02X%02X%02X%02X]" TEXT_COLOR,
+			last_keys[0], last_keys[1], last_keys[2], last_keys[3], last_keys[4],
+			last_keys[5]);
+	outstr(env->linebuf);
+#endif
+}
+
+void display_text(struct editor *ed, int pos, int end, int col, int margin,
+		unsigned char *attrs) {
+	// Draw text from pos up to end, or the end of the line if end is -1,
+	// starting at column col with margin more columns off screen. attrs
+	// holds the highlight class of each byte from pos, or is NULL.
+	int hilite = 0, color = HL_TEXT;
+	int maxcol = ed->width + col + margin;
+	char *linebuf = ed->env->linebuf;
+	char *bufptr = linebuf;
+	unsigned char *p = text_ptr(ed, pos);
+	int selstart, selend, ch, len, w;
+	char *s;
+
+	get_selection(ed, &selstart, &selend);
+	while (col < maxcol) {
+		if (margin == 0) {
+			if (!hilite && pos >= selstart && pos < selend) {
+				if (color != HL_TEXT) {
+					for (s = TEXT_COLOR; *s; s++)
+						*bufptr++ = *s;
+					color = HL_TEXT;
+				}
+				for (s = SELECT_COLOR; *s; s++)
+					*bufptr++ = *s;
+				hilite = 1;
+			} else if (hilite && pos >= selend) {
+				for (s = TEXT_COLOR; *s; s++)
+					*bufptr++ = *s;
+				hilite = 0;
+			}
+		}
+
+		if (p == ed->end || (end >= 0 && pos >= end))
+			break;
+		if (bufptr - linebuf > ed->env->cols * 2) {
+			// Multibyte characters can take more than the line buffer holds
+			outbuf(linebuf, bufptr - linebuf);
+			bufptr = linebuf;
+		}
+		if (attrs && margin == 0 && !hilite && *attrs != color) {
+			color = *attrs;
+			for (s = syntax_colors[color]; *s; s++)
+				*bufptr++ = *s;
+		}
+
+		// Copy plain ASCII up to the end of the text, selection or color
+		len = plain_text(ed, p, maxcol - col);
+		if (end >= 0 && len > end - pos)
+			len = end - pos;
+		if (margin > 0 && len > margin)
+			len = margin;
+		if (margin == 0 && pos < selstart && len > selstart - pos)
+			len = selstart - pos;
+		if (hilite && len > selend - pos)
+			len = selend - pos;
+		if (attrs && len > 0) {
+			for (w = 1; w < len && attrs[w] == attrs[0]; w++);
+			len = w;
+		}
+		if (len > 0) {
+			if (margin > 0) {
+				margin -= len;
+			} else {
+				memcpy(bufptr, p, len);
+				bufptr += len;
+			}
+			col += len;
+		} else {
+			ch = *p;
+			if (ch == '\r' || ch == '\n')
+				break;
+
+			if (ch == '\t') {
+				len = 1;
+				w = TABSIZE - col % TABSIZE;
+				ch = ' ';
+			} else {
+				ch = decode_char(ed, p, &len);
+				w = ch < 0 ? 1 : char_width(ch);
+			}
+
+			if (ch == ' ' || margin > 0 || col + w > maxcol) {
+				// Blank out tabs and wide characters that are cut off
+				while (w > 0 && col < maxcol) {
+					if (margin > 0) {
+						margin--;
+					} else {
+						*bufptr++ = ' ';
+					}
+					col++;
+					w--;
+				}
+			} else if (!printable(ch)) {
+				*bufptr++ = '?';
+				col++;
+			} else {
+				copy(ed, (unsigned char *) bufptr, pos, len);
+				bufptr += len;
+				col += w;
+			}
+		}
+
+		p = skip_bytes(ed, p, len);
+		pos += len;
+		if (attrs)
+			attrs += len;
+	}
+
+	if (color != HL_TEXT) {
+		for (s = TEXT_COLOR; *s; s++)
+			*bufptr++ = *s;
+	}
+	if (hilite || ed->left + ed->width < ed->env->cols) {
+		// Fill the selection, or a view with others to its right, with
+		// blanks up to the edge
+		if (col < maxcol - ed->width)
+			col = maxcol - ed->width;
+		while (col < maxcol) {
+			*bufptr++ = ' ';
+			col++;
+		}
+	} else {
+		if (col == margin)
+			*bufptr++ = ' ';
+	}
+
+	if (col < maxcol) {
+		for (s = CLREOL; *s; s++)
+			*bufptr++ = *s;
+	}
+
+	if (hilite) {
+		for (s = TEXT_COLOR; *s; s++)
+			*bufptr++ = *s;
+	}
+
+	outbuf(linebuf, bufptr - linebuf);
+}
+
+void display_line(struct editor *ed, int pos, unsigned char *attrs) {
+	int col, n;
+
+	// Skip the text left of the margin
+	n = skip_columns(ed, pos, ed->margin, &col);
+	display_text(ed, pos + n, -1, col, ed->margin - col, attrs ? attrs + n : NULL);
+}
+
+void display_row(struct editor *ed, int linepos, int row, unsigned char *attrs) {
+	int start = wrap_start(ed, linepos, row);
+
+	display_text(ed, linepos + start, linepos + wrap_end(ed, linepos, row), 0, 0,
+			attrs ? attrs + start : NULL);
+}
+
+int row_width(struct editor *ed, int pos, int len) {
+	// Return the columns taken by len characters from the start of a row
+	unsigned char *p = text_ptr(ed, pos);
+	int c = 0, n;
+
+	while (len > 0 && p != ed->end) {
+		n = plain_text(ed, p, len);
+		if (n > 0)
+			c += n;
+		else
+			c += char_columns(ed, p, c, &n);
+		len -= n;
+		p = skip_bytes(ed, p, n);
+	}
+	return c;
+}
+
+int step_row(struct editor *ed, int *linepos, int *line, int *row, int dir, int wait) {
+	// Move a line position and row one row down or up in wrap mode.
+	// Returns -1 at the start or end of the text.
+	int newpos;
+
+	if (dir > 0) {
+		if (wrap_start(ed, *linepos, *row + 1) >= 0) {
+			(*row)++;
+			return 0;
+		}
+		while ((newpos = next_line(ed, *linepos)) < 0)
+			if (!wait || !wait_load(ed, 0))
+				return -1;
+		*linepos = newpos;
+		(*line)++;
+		*row = 0;
+	} else {
+		if (*row > 0) {
+			(*row)--;
+			return 0;
+		}
+		newpos = prev_line(ed, *linepos);
+		if (newpos < 0)
+			return -1;
+		*linepos = newpos;
+		(*line)--;
+		*row = wrap_rows(ed, newpos) - 1;
+	}
+	return 0;
+}
+
+void scroll_wrap(struct editor *ed) {
+	// Scroll the rows in wrap mode so the cursor is on screen and find
+	// where it is. Redraw everything if the rows of the cursor line that
+	// were updated in place no longer take up the same space.
+	int lines = ed->height;
+	int row = wrap_row(ed, ed->linepos, ed->col);
+	int pos, line, r, y, rows;
+
+	if (ed->toprow > 0 && wrap_start(ed, ed->toppos, ed->toprow) < 0)
+		ed->toprow = 0;
+
+	if (ed->line < ed->topline || (ed->line == ed->topline && row < ed->toprow)) {
+		ed->toppos = ed->linepos;
+		ed->topline = ed->line;
+		ed->toprow = row;
+		ed->refresh = 1;
+	}
+
+	// Count the rows from the top of the screen down to the cursor
+	pos = ed->toppos;
+	line = ed->topline;
+	r = ed->toprow;
+	for (y = 0; y < lines; y++) {
+		if (pos == ed->linepos && r == row)
+			break;
+		if (step_row(ed, &pos, &line, &r, 1, 0) < 0)
+			break;
+	}
+
+	if (y >= lines || pos != ed->linepos || r != row) {
+		// Put the cursor on the bottom row
+		pos = ed->linepos;
+		line = ed->line;
+		r = row;
+		for (y = 0; y < lines - 1; y++) {
+			if (step_row(ed, &pos, &line, &r, -1, 0) < 0)
+				break;
+		}
+		ed->toppos = pos;
+		ed->topline = line;
+		ed->toprow = r;
+		ed->refresh = 1;
+	}
+	ed->cursory = y;
+
+	// Count the rows of the cursor line on screen
+	r = row + 1;
+	while (y + r - row < lines && wrap_start(ed, ed->linepos, r) >= 0)
+		r++;
+	rows = r - (ed->linepos == ed->toppos ? ed->toprow : 0);
+	if (ed->lineupdate && rows != ed->cursorrows)
+		ed->refresh = 1;
+	ed->cursorrows = rows;
+}
+
+void draw_screen(struct editor *ed) {
+	int pos, line, row, state, attrline = -1;
+	unsigned char *attrs = NULL;
+	int i;
+
+	outstr(TEXT_COLOR);
+	pos = ed->toppos;
+	line = ed->topline;
+	row = ed->toprow;
+	state = line_state(ed, line, pos);
+	for (i = 0; i < ed->height; i++) {
+		if (pos >= 0 && line != attrline) {
+			attrs = syntax_line(ed, pos, line, &state);
+			attrline = line;
+		}
+		gotoxy(ed->left, ed->top + i);
+		if (pos < 0) {
+			display_text(ed, text_length(ed), text_length(ed), 0, 0, NULL);
+		} else if (ed->wrap) {
+			display_row(ed, pos, row, attrs);
+			if (step_row(ed, &pos, &line, &row, 1, 0) < 0)
+				pos = -1;
+		} else {
+			display_line(ed, pos, attrs);
+			pos = next_line(ed, pos);
+			line++;
+		}
+	}
+}
+
+void update_line(struct editor *ed) {
+	int row, first, y, state, old;
+	unsigned char *attrs;
+
+	// Redraw everything if the line now ends in a different lexer state
+	state = line_state(ed, ed->line, ed->linepos);
+	old = ed->line + 1 < ed->nstates ? ed->states[ed->line + 1] : -1;
+	attrs = syntax_line(ed, ed->linepos, ed->line, &state);
+	if (attrs && state != old && next_line(ed, ed->linepos) >= 0) {
+		draw_screen(ed);
+		return;
+	}
+
+	if (!ed->wrap) {
+		gotoxy(ed->left, ed->top + ed->line - ed->topline);
+		display_line(ed, ed->linepos, attrs);
+		return;
+	}
+
+	// Redraw the rows of the cursor line on screen
+	row = wrap_row(ed, ed->linepos, ed->col);
+	first = ed->linepos == ed->toppos ? ed->toprow : 0;
+	y = ed->cursory - (row - first);
+	for (row = first; row < first + ed->cursorrows; row++, y++) {
+		gotoxy(ed->left, ed->top + y);
+		display_row(ed, ed->linepos, row, attrs);
+	}
+}
+
+void position_cursor(struct editor *ed) {
+	int col, start;
+
+	if (ed->wrap) {
+		start = wrap_start(ed, ed->linepos, wrap_row(ed, ed->linepos, ed->col));
+		col = row_width(ed, ed->linepos + start, ed->col - start);
+		gotoxy(ed->left + col, ed->top + ed->cursory);
+		return;
+	}
+	col = column(ed, ed->linepos, ed->col);
+	gotoxy(ed->left + col - ed->margin, ed->top + ed->line - ed->topline);
+}
+
+//
+// Cursor movement
+//
+
+void adjust(struct editor *ed) {
+	int col;
+	int ll = line_length(ed, ed->linepos);
+	ed->col = ed->lastcol;
+	if (ed->col > ll)
+		ed->col = ll;
+	ed->col = char_start(ed, ed->linepos + ed->col, ed->linepos) - ed->linepos;
+	if (ed->wrap)
+		return;
+
+	// Scroll horizontally in steps of 4 columns until the cursor is visible
+	col = column(ed, ed->linepos, ed->col);
+	if (col < ed->margin) {
+		ed->margin -= (ed->margin - col + 3) / 4 * 4;
+		if (ed->margin < 0)
+			ed->margin = 0;
+		ed->refresh = 1;
+	}
+	if (col - ed->margin >= ed->width) {
+		ed->margin += (col - ed->margin - ed->width) / 4 * 4 + 4;
+		ed->refresh = 1;
+	}
+}
+
+void move_rows(struct editor *ed, int rows, int select, int scroll) {
+	// Move the cursor rows down, or up if negative, in wrap mode keeping
+	// it in the same screen column. With scroll the top of the screen
+	// moves by the same number of rows.
+	int row = wrap_row(ed, ed->linepos, ed->col);
+	int start = wrap_start(ed, ed->linepos, row);
+	int x = row_width(ed, ed->linepos + start, ed->col - start);
+	int dir = rows > 0 ? 1 : -1;
+	int end, c, w, len;
+	unsigned char *p;
+
+	update_selection(ed, select);
+	for (; rows != 0; rows -= dir) {
+		if (step_row(ed, &ed->linepos, &ed->line, &row, dir, 1) < 0)
+			break;
+		if (scroll && step_row(ed, &ed->toppos, &ed->topline, &ed->toprow, dir, 0) == 0)
+			ed->refresh = 1;
+	}
+
+	// Find the character at the same column, staying before the start
+	// of the next row
+	start = wrap_start(ed, ed->linepos, row);
+	end = wrap_end(ed, ed->linepos, row);
+	if (wrap_start(ed, ed->linepos, row + 1) >= 0)
+		end = char_start(ed, ed->linepos + end - 1, ed->linepos + start) - ed->linepos;
+	p = text_ptr(ed, ed->linepos + start);
+	for (c = 0; start < end; start += len) {
+		w = char_columns(ed, p, c, &len);
+		if (c + w > x)
+			break;
+		c += w;
+		p = skip_bytes(ed, p, len);
+	}
+	ed->col = ed->lastcol = start;
+	adjust(ed);
+}
+
+void up(struct editor *ed, int select) {
+	int newpos;
+
+	if (ed->wrap) {
+		move_rows(ed, -1, select, 0);
+		return;
+	}
+	newpos = prev_line(ed, ed->linepos);
+	if (newpos < 0)
+		return;
+
+	update_selection(ed, select);
+
+	ed->linepos = newpos;
+	ed->line--;
+	if (ed->line < ed->topline) {
+		ed->toppos = ed->linepos;
+		ed->topline = ed->line;
+		ed->refresh = 1;
+	}
+
+	adjust(ed);
+}
+
+void down(struct editor *ed, int select) {
+	int newpos;
+
+	if (ed->wrap) {
+		move_rows(ed, 1, select, 0);
+		return;
+	}
+	while ((newpos = next_line(ed, ed->linepos)) < 0)
+		if (!wait_load(ed, 0))
+			return;
+
+	update_selection(ed, select);
+
+	ed->linepos = newpos;
+	ed->line++;
+
+	if (ed->line >= ed->topline + ed->height) {
+		ed->toppos = next_line(ed, ed->toppos);
+		ed->topline++;
+		ed->refresh = 1;
+	}
+
+	adjust(ed);
+}
+
+void left(struct editor *ed, int select) {
+	update_selection(ed, select);
+	if (ed->col > 0) {
+		ed->col = char_start(ed, ed->linepos + ed->col - 1, ed->linepos) - ed->linepos;
+	} else {
+		int newpos = prev_line(ed, ed->linepos);
+		if (newpos < 0)
+			return;
+
+		ed->col = line_length(ed, newpos);
+		ed->linepos = newpos;
+		ed->line--;
+		if (ed->line < ed->topline) {
+			ed->toppos = ed->linepos;
+			ed->topline = ed->line;
+			ed->refresh = 1;
+		}
+	}
+
+	ed->lastcol = ed->col;
+	adjust(ed);
+}
+
+void right(struct editor *ed, int select) {
+	update_selection(ed, select);
+	if (ed->col < line_length(ed, ed->linepos)) {
+		ed->col += char_length(ed, ed->linepos + ed->col);
+	} else {
+		int newpos;
+		while ((newpos = next_line(ed, ed->linepos)) < 0)
+			if (!wait_load(ed, 0))
+				return;
+
+		ed->col = 0;
+		ed->linepos = newpos;
+		ed->line++;
+
+		if (ed->line >= ed->topline + ed->height) {
+			ed->toppos = next_line(ed, ed->toppos);
+			ed->topline++;
+			ed->refresh = 1;
+		}
+	}
+
+	ed->lastcol = ed->col;
+	adjust(ed);
+}
+
+int wordchar(int ch) {
+	return (ch >= 'A' && ch <= 'Z')
+		|| (ch >= 'a' && ch <= 'z')
+		|| (ch >= '0' && ch <= '9')
+		|| ch >= 0x80;
+}
 
 void wordleft(struct editor *ed, int select) {
 	int pos, phase;
@@ -1005,367 +4589,1277 @@ void wordleft(struct editor *ed, int select) {
 				break;
 		}
 
-		pos--;
-		if (pos < ed->linepos) {
-			ed->linepos = prev_line(ed, ed->linepos);
-			ed->line--;
-			ed->refresh = 1;
+		pos--;
+		if (pos < ed->linepos) {
+			ed->linepos = prev_line(ed, ed->linepos);
+			ed->line--;
+			ed->refresh = 1;
+		}
+	}
+	ed->col = pos - ed->linepos;
+	if (ed->line < ed->topline) {
+		ed->toppos = ed->linepos;
+		ed->topline = ed->line;
+	}
+
+	ed->lastcol = ed->col;
+	adjust(ed);
+}
+
+void wordright(struct editor *ed, int select) {
+	int pos, end, phase, next;
+
+	update_selection(ed, select);
+	pos = ed->linepos + ed->col;
+	end = text_length(ed);
+	next = next_line(ed, ed->linepos);
+	phase = 0;
+	while (pos < end) {
+		int ch = get(ed, pos);
+		if (phase == 0) {
+			if (wordchar(ch))
+				phase = 1;
+		} else {
+			if (!wordchar(ch))
+				break;
+		}
+
+		pos++;
+		if (pos == next) {
+			ed->linepos = next;
+			next = next_line(ed, ed->linepos);
+			ed->line++;
+			ed->refresh = 1;
+		}
+	}
+	ed->col = pos - ed->linepos;
+	if (ed->line >= ed->topline + ed->height) {
+		ed->toppos = next_line(ed, ed->toppos);
+		ed->topline++;
+	}
+
+	ed->lastcol = ed->col;
+	adjust(ed);
+}
+
+void home(struct editor *ed, int select) {
+	update_selection(ed, select);
+	ed->col = ed->lastcol = 0;
+	adjust(ed);
+}
+
+void end(struct editor *ed, int select) {
+	update_selection(ed, select);
+	ed->col = ed->lastcol = line_length(ed, ed->linepos);
+	adjust(ed);
+}
+
+void top(struct editor *ed, int select) {
+	push_jump(ed);
+	update_selection(ed, select);
+	ed->toppos = ed->topline = ed->toprow = ed->margin = 0;
+	ed->linepos = ed->line = ed->col = ed->lastcol = 0;
+	ed->refresh = 1;
+}
+
+void bottom(struct editor *ed, int select) {
+	wait_load(ed, 1);
+	push_jump(ed);
+	update_selection(ed, select);
+	for (;;) {
+		int newpos = next_line(ed, ed->linepos);
+		if (newpos < 0)
+			break;
+
+		ed->linepos = newpos;
+		ed->line++;
+
+		if (ed->line >= ed->topline + ed->height) {
+			ed->toppos = next_line(ed, ed->toppos);
+			ed->topline++;
+			ed->refresh = 1;
+		}
+	}
+	ed->col = ed->lastcol = line_length(ed, ed->linepos);
+	adjust(ed);
+}
+
+void pageup(struct editor *ed, int select) {
+	int i;
+
+	if (ed->wrap) {
+		move_rows(ed, -ed->height, select, 1);
+		return;
+	}
+	update_selection(ed, select);
+	if (ed->line < ed->height) {
+		ed->linepos = ed->toppos = 0;
+		ed->line = ed->topline = 0;
+	} else {
+		for (i = 0; i < ed->height; i++) {
+			int newpos = prev_line(ed, ed->linepos);
+			if (newpos < 0)
+				return;
+
+			ed->linepos = newpos;
+			ed->line--;
+
+			if (ed->topline > 0) {
+				ed->toppos = prev_line(ed, ed->toppos);
+				ed->topline--;
+			}
+		}
+	}
+
+	ed->refresh = 1;
+	adjust(ed);
+}
+
+void pagedown(struct editor *ed, int select) {
+	int i;
+
+	if (ed->wrap) {
+		move_rows(ed, ed->height, select, 1);
+		return;
+	}
+	update_selection(ed, select);
+	for (i = 0; i < ed->height; i++) {
+		int newpos;
+		while ((newpos = next_line(ed, ed->linepos)) < 0)
+			if (!wait_load(ed, 0))
+				break;
+		if (newpos < 0)
+			break;
+
+		ed->linepos = newpos;
+		ed->line++;
+
+		ed->toppos = next_line(ed, ed->toppos);
+		ed->topline++;
+	}
+
+	ed->refresh = 1;
+	adjust(ed);
+}
+
+//
+// Text editing
+//
+
+void insert_char(struct editor *ed, int ch) {
+	unsigned char buf[UTF8MAX];
+	int len = 1, n;
+
+	// Read the rest of a multibyte character from the terminal
+	buf[0] = ch;
+	n = ch >= 0xF0 ? 4 : ch >= 0xE0 ? 3 : ch >= 0xC0 ? 2 : 1;
+	while (len < n) {
+		ch = getchar_logged();
+		if ((ch & 0xC0) != 0x80) {
+			if (ch >= 0)
+				ungetc(ch, stdin);
+			break;
 		}
-	}
-	ed->col = pos - ed->linepos;
-	if (ed->line < ed->topline) {
-		ed->toppos = ed->linepos;
-		ed->topline = ed->line;
+		buf[len++] = ch;
 	}
 
+	erase_selection(ed);
+	insert(ed, ed->linepos + ed->col, buf, len);
+	ed->col += len;
 	ed->lastcol = ed->col;
 	adjust(ed);
+	if (!ed->refresh)
+		ed->lineupdate = 1;
 }
 
-void wordright(struct editor *ed, int select) {
-	int pos, end, phase, next;
+void newline(struct editor *ed) {
+	int p;
+	unsigned char ch;
 
-	update_selection(ed, select);
-	pos = ed->linepos + ed->col;
-	end = text_length(ed);
-	next = next_line(ed, ed->linepos);
-	phase = 0;
-	while (pos < end) {
-		int ch = get(ed, pos);
-		if (phase == 0) {
-			if (wordchar(ch))
-				phase = 1;
-		} else {
-			if (!wordchar(ch))
-				break;
-		}
+	erase_selection(ed);
+	insert(ed, ed->linepos + ed->col, NEW_LINE, 1);
+	ed->col = ed->lastcol = 0;
+	ed->line++;
+	p = ed->linepos;
+	ed->linepos = next_line(ed, ed->linepos);
 
-		pos++;
-		if (pos == next) {
-			ed->linepos = next;
-			next = next_line(ed, ed->linepos);
-			ed->line++;
-			ed->refresh = 1;
+	// This causes whitespace to be copied over to new lines.
+	// Causes issues if pasting text in, so disabled for now.
+	/*
+	for (;;) {
+		ch = get(ed, p++);
+		if (ch == ' ' || ch == '\t') {
+			insert(ed, ed->linepos + ed->col, &ch, 1);
+			ed->col++;
+		} else {
+			break;
 		}
 	}
-	ed->col = pos - ed->linepos;
-	if (ed->line >= ed->topline + ed->env->lines) {
+	*/
+
+	ed->lastcol = ed->col;
+
+	ed->refresh = 1;
+
+	if (ed->line >= ed->topline + ed->height) {
 		ed->toppos = next_line(ed, ed->toppos);
 		ed->topline++;
+		ed->refresh = 1;
 	}
 
-	ed->lastcol = ed->col;
 	adjust(ed);
 }
 
-void home(struct editor *ed, int select) {
-	update_selection(ed, select);
-	ed->col = ed->lastcol = 0;
+void backspace(struct editor *ed) {
+	if (erase_selection(ed))
+		return;
+	if (ed->linepos + ed->col == 0)
+		return;
+	if (ed->col == 0) {
+		int pos = ed->linepos;
+		erase_section(ed, --pos, 1);
+		if (get(ed, pos - 1) == '\r')
+			erase_section(ed, --pos, 1);
+
+		ed->line--;
+		ed->linepos = line_start(ed, pos);
+		ed->col = pos - ed->linepos;
+		ed->refresh = 1;
+
+		if (ed->line < ed->topline) {
+			ed->toppos = ed->linepos;
+			ed->topline = ed->line;
+		}
+	} else {
+		int pos = char_start(ed, ed->linepos + ed->col - 1, ed->linepos);
+		erase_section(ed, pos, ed->linepos + ed->col - pos);
+		ed->col = pos - ed->linepos;
+		ed->lineupdate = 1;
+	}
+
+	ed->lastcol = ed->col;
 	adjust(ed);
 }
 
-void end(struct editor *ed, int select) {
-	update_selection(ed, select);
-	ed->col = ed->lastcol = line_length(ed, ed->linepos);
-	adjust(ed);
+void del(struct editor *ed) {
+	int pos, ch;
+
+	if (erase_selection(ed))
+		return;
+	pos = ed->linepos + ed->col;
+	ch = get(ed, pos);
+	if (ch < 0)
+		return;
+
+	erase_section(ed, pos, char_length(ed, pos));
+	if (ch == '\r') {
+		ch = get(ed, pos);
+		if (ch == '\n')
+			erase_section(ed, pos, 1);
+	}
+
+	if (ch == '\n') {
+		ed->refresh = 1;
+	} else {
+		ed->lineupdate = 1;
+	}
 }
 
-void top(struct editor *ed, int select) {
-	update_selection(ed, select);
-	ed->toppos = ed->topline = ed->margin = 0;
-	ed->linepos = ed->line = ed->col = ed->lastcol = 0;
+int common_ends(struct editor *ed, unsigned char *buf, int newlen, int *tail) {
+	// Find how much the text and buf have in common at the start and at
+	// the end, so only the part in between needs to be replaced. Returns
+	// the length of the common start.
+	unsigned char *text;
+	int len = text_length(ed);
+	int head, n;
+
+	close_gap(ed);
+	text = ed->start;
+	n = len < newlen ? len : newlen;
+	for (head = 0; head + 4096 <= n; head += 4096) {
+		if (memcmp(text + head, buf + head, 4096) != 0)
+			break;
+	}
+	while (head < n && text[head] == buf[head])
+		head++;
+	n -= head;
+	for (*tail = 0; *tail + 4096 <= n; *tail += 4096) {
+		if (memcmp(text + len - *tail - 4096, buf + newlen - *tail - 4096, 4096) != 0)
+			break;
+	}
+	while (*tail < n && text[len - *tail - 1] == buf[newlen - *tail - 1])
+		(*tail)++;
+	return head;
+}
+
+int restore_checkpoint(struct editor *ed, struct undo *undo) {
+	// Replace the text with the state saved after undo
+	unsigned char *buf;
+	int len, head, tail;
+
+	if (pread(ed->spillfd, &len, sizeof(int), undo->checkpoint) != sizeof(int))
+		return -1;
+	buf = malloc(len);
+	if (!buf)
+		return -1;
+	if (pread(ed->spillfd, buf, len, undo->checkpoint + sizeof(int)) != len) {
+		free(buf);
+		return -1;
+	}
+	// Only replace what differs, so marks, other views and the record of
+	// modified ranges outside it are kept
+	head = common_ends(ed, buf, len, &tail);
+	if (head + tail < text_length(ed) || head + tail < len)
+		replace(ed, head, text_length(ed) - head - tail, buf + head, len - head - tail, 0);
+	free(buf);
+	ed->undo = undo;
+	return 0;
+}
+
+int undo_step(struct editor *ed) {
+	// Revert the current undo buffer, returning to its parent state
+	struct undo *undo = ed->undo;
+	unsigned char *buf;
+
+	seal_undo(undo);
+	buf = undo_text(ed, undo, 0);
+	if (!buf && undo->erased > 0)
+		return -1;
+	replace(ed, undo->pos, undo->inserted, buf, undo->erased, 0);
+	if (buf != undo->undobuf)
+		free(buf);
+
+	// Redo takes the same branch back
+	if (undo->prev)
+		undo->prev->child = undo;
+	else
+		ed->rootchild = undo;
+	ed->undo = undo->prev;
+	return 0;
+}
+
+int redo_step(struct editor *ed, struct undo *undo) {
+	// Apply a child undo buffer of the current state
+	unsigned char *buf;
+
+	buf = undo_text(ed, undo, 1);
+	if (!buf && undo->inserted > 0)
+		return -1;
+	replace(ed, undo->pos, undo->erased, buf, undo->inserted, 0);
+	if (buf != undo->redobuf)
+		free(buf);
+	ed->undo = undo;
+	return 0;
+}
+
+void undo(struct editor *ed) {
+	int pos;
+
+	if (ed->loadhistory)
+		load_history(ed);
+	if (!ed->undo)
+		return;
+	pos = ed->undo->pos;
+	if (undo_step(ed) < 0) {
+		outch('\007');
+		return;
+	}
+	moveto(ed, pos, 0);
+	ed->dirty = ed->savelost || ed->undo != ed->saveundo;
 	ed->refresh = 1;
 }
 
-void bottom(struct editor *ed, int select) {
-	update_selection(ed, select);
-	for (;;) {
-		int newpos = next_line(ed, ed->linepos);
-		if (newpos < 0)
+void redo(struct editor *ed) {
+	struct undo *undo;
+
+	if (ed->loadhistory)
+		load_history(ed);
+	undo = ed->undo ? ed->undo->child : ed->rootchild;
+	if (!undo)
+		return;
+	if (redo_step(ed, undo) < 0) {
+		outch('\007');
+		return;
+	}
+	moveto(ed, undo->pos, 0);
+	ed->dirty = ed->savelost || ed->undo != ed->saveundo;
+	ed->refresh = 1;
+}
+
+void goto_undo(struct editor *ed, struct undo *target) {
+	// Move through the undo tree to the state after target, undoing up
+	// to the nearest common ancestor and redoing down from there, or
+	// starting from a checkpoint on the way to target if that is cheaper
+	struct undo *from = ed->undo;
+	struct undo *to = target;
+	struct undo *undo;
+	long long cost = 0, replay = 0;
+	int pos = -1;
+
+	while (from && (!to || from->depth > to->depth)) {
+		cost += replay_cost(from);
+		from = from->prev;
+	}
+	while (to && (!from || to->depth > from->depth)) {
+		cost += replay_cost(to);
+		to = to->prev;
+	}
+	while (from != to) {
+		cost += replay_cost(from) + replay_cost(to);
+		from = from->prev;
+		to = to->prev;
+	}
+
+	for (undo = target; undo && undo->checkpoint < 0 && replay < cost; undo = undo->prev)
+		replay += replay_cost(undo);
+	if (undo && undo->checkpoint >= 0 && replay + 2LL * text_length(ed) < cost
+			&& restore_checkpoint(ed, undo) == 0) {
+		from = undo;
+		pos = undo->pos;
+	}
+
+	while (ed->undo != from) {
+		pos = ed->undo->pos;
+		if (undo_step(ed) < 0)
+			break;
+	}
+	if (ed->undo == from) {
+		for (undo = target; undo != from; undo = undo->prev) {
+			if (undo->prev)
+				undo->prev->child = undo;
+			else
+				ed->rootchild = undo;
+		}
+	}
+	while (ed->undo == from && ed->undo != target) {
+		undo = ed->undo ? ed->undo->child : ed->rootchild;
+		if (redo_step(ed, undo) < 0)
 			break;
+		pos = undo->pos;
+		from = undo;
+	}
+	if (ed->undo != target)
+		outch('\007');
+
+	if (pos >= 0)
+		moveto(ed, pos, 0);
+	ed->dirty = ed->savelost || ed->undo != ed->saveundo;
+	ed->refresh = 1;
+}
+
+void revert_undo(struct editor *ed) {
+	// Go back to the state saved in the file
+	if (ed->loadhistory)
+		load_history(ed);
+	if (ed->savelost) {
+		outch('\007');
+		return;
+	}
+	if (ed->undo != ed->saveundo)
+		goto_undo(ed, ed->saveundo);
+}
+
+void earlier(struct editor *ed) {
+	// Go to the state before the most recent change in time
+	if (ed->loadhistory)
+		load_history(ed);
+	if (ed->undo)
+		goto_undo(ed, ed->undo->before);
+}
+
+void later(struct editor *ed) {
+	// Go to the state after the next change in time
+	struct undo *undo;
+
+	if (ed->loadhistory)
+		load_history(ed);
+	undo = ed->undo ? ed->undo->next : ed->undohead;
+	if (undo)
+		goto_undo(ed, undo);
+}
+
+//
+// Clipboard
+//
+
+void copy_selection(struct editor *ed) {
+	int selstart, selend;
+
+	if (!get_selection(ed, &selstart, &selend))
+		return;
+	ed->env->clipsize = selend - selstart;
+	ed->env->clipboard = realloc(ed->env->clipboard,
+			ed->env->clipsize);
+	copy(ed, ed->env->clipboard, selstart, ed->env->clipsize);
+}
+
+void cut_selection(struct editor *ed) {
+	copy_selection(ed);
+	erase_selection(ed);
+}
+
+void paste_selection(struct editor *ed) {
+	erase_selection(ed);
+	insert(ed, ed->linepos + ed->col, ed->env->clipboard, ed->env->clipsize);
+	moveto(ed, ed->linepos + ed->col + ed->env->clipsize, 0);
+	ed->refresh = 1;
+}
+
+//
+// Split views
+//
+// The views of an editor tile the screen above the status line, with a
+// line or column of separators between neighbours. Splitting a view
+// halves it, and closing one gives its area to the views next to it.
+//
+
+void save_view(struct editor *ed, struct view *v) {
+	v->toppos = ed->toppos;
+	v->topline = ed->topline;
+	v->toprow = ed->toprow;
+	v->margin = ed->margin;
+	v->linepos = ed->linepos;
+	v->line = ed->line;
+	v->col = ed->col;
+	v->lastcol = ed->lastcol;
+	v->anchor = ed->anchor;
+	v->wrap = ed->wrap;
+	v->cursory = ed->cursory;
+	v->cursorrows = ed->cursorrows;
+	v->top = ed->top;
+	v->left = ed->left;
+	v->height = ed->height;
+	v->width = ed->width;
+}
+
+void load_view(struct editor *ed, struct view *v) {
+	ed->toppos = v->toppos;
+	ed->topline = v->topline;
+	ed->toprow = v->toprow;
+	ed->margin = v->margin;
+	ed->linepos = v->linepos;
+	ed->line = v->line;
+	ed->col = v->col;
+	ed->lastcol = v->lastcol;
+	ed->anchor = v->anchor;
+	ed->wrap = v->wrap;
+	ed->cursory = v->cursory;
+	ed->cursorrows = v->cursorrows;
+	ed->top = v->top;
+	ed->left = v->left;
+	ed->height = v->height;
+	ed->width = v->width;
+	if (ed->wrap && ed->toprow > 0 && wrap_start(ed, ed->toppos, ed->toprow) < 0)
+		ed->toprow = 0;
+}
+
+void show_cursor(struct editor *ed) {
+	// Scroll the current view so the cursor is in it after the view
+	// changed, and draw all views again
+	int lastcol = ed->lastcol;
+
+	if (!ed->wrap) {
+		if (ed->line < ed->topline) {
+			ed->toppos = ed->linepos;
+			ed->topline = ed->line;
+		}
+		while (ed->line >= ed->topline + ed->height) {
+			ed->toppos = next_line(ed, ed->toppos);
+			ed->topline++;
+		}
+		ed->lastcol = ed->col;
+		adjust(ed);
+		ed->lastcol = lastcol;
+	}
+	ed->env->shown = NULL;
+	ed->refresh = 1;
+}
+
+int scale_edge(int edge, int size, int newsize) {
+	// Move the edge of a view when the screen changes size. Separators
+	// stay just after the edge before them.
+	if (edge >= size)
+		return newsize;
+	return edge * newsize / size;
+}
+
+void fit_views(struct editor *ed) {
+	// Lay out the views again when the screen has changed size
+	struct env *env = ed->env;
+	struct view *v;
+	int i, top, left, bottom, right, fits = 1;
+
+	if (ed->layoutlines == env->lines && ed->layoutcols == env->cols)
+		return;
+	if (ed->nviews == 0) {
+		ed->nviews = 1;
+		ed->layoutlines = ed->layoutcols = 0;
+	}
+	save_view(ed, &ed->views[ed->curview]);
+
+	for (i = 0; i < ed->nviews && ed->layoutlines > 0; i++) {
+		v = &ed->views[i];
+		top = v->top ? scale_edge(v->top - 1, ed->layoutlines, env->lines) + 1 : 0;
+		left = v->left ? scale_edge(v->left - 1, ed->layoutcols, env->cols) + 1 : 0;
+		bottom = scale_edge(v->top + v->height, ed->layoutlines, env->lines);
+		right = scale_edge(v->left + v->width, ed->layoutcols, env->cols);
+		if (bottom <= top || right <= left)
+			fits = 0;
+		v->top = top;
+		v->left = left;
+		v->height = bottom - top;
+		v->width = right - left;
+		v->version = -1;
+	}
 
-		ed->linepos = newpos;
-		ed->line++;
+	if (ed->layoutlines == 0 || !fits) {
+		// Start over with the current view on the whole screen
+		ed->views[0] = ed->views[ed->curview];
+		ed->nviews = 1;
+		ed->curview = 0;
+		v = &ed->views[0];
+		v->top = v->left = 0;
+		v->height = env->lines;
+		v->width = env->cols;
+	}
+	ed->layoutlines = env->lines;
+	ed->layoutcols = env->cols;
+	load_view(ed, &ed->views[ed->curview]);
+	show_cursor(ed);
+}
 
-		if (ed->line >= ed->topline + ed->env->lines) {
-			ed->toppos = next_line(ed, ed->toppos);
-			ed->topline++;
-			ed->refresh = 1;
+void draw_separators(struct editor *ed) {
+	struct env *env = ed->env;
+	struct view *v;
+	int i, y, x;
+
+	outstr(STATUS_COLOR);
+	for (i = 0; i < ed->nviews; i++) {
+		v = &ed->views[i];
+		if (v->top + v->height < env->lines) {
+			gotoxy(v->left, v->top + v->height);
+			for (x = 0; x < v->width; x++)
+				outch('-');
+			if (v->left + v->width < env->cols)
+				outch('+');
+		}
+		if (v->left + v->width < env->cols) {
+			for (y = 0; y < v->height; y++) {
+				gotoxy(v->left + v->width, v->top + y);
+				outch('|');
+			}
 		}
 	}
-	ed->col = ed->lastcol = line_length(ed, ed->linepos);
-	adjust(ed);
+	outstr(TEXT_COLOR);
 }
 
-void pageup(struct editor *ed, int select) {
+void draw_other_views(struct editor *ed, int all) {
+	// Draw the views other than the current one that show an older
+	// version of the text, or all of them
+	struct env *env = ed->env;
+	struct view *v;
 	int i;
 
-	update_selection(ed, select);
-	if (ed->line < ed->env->lines) {
-		ed->linepos = ed->toppos = 0;
-		ed->line = ed->topline = 0;
+	if (env->shown != ed)
+		all = 1;
+	env->shown = ed;
+	if (ed->nviews < 2)
+		return;
+
+	save_view(ed, &ed->views[ed->curview]);
+	for (i = 0; i < ed->nviews; i++) {
+		v = &ed->views[i];
+		if (i == ed->curview || (!all && v->version == ed->version))
+			continue;
+		load_view(ed, v);
+		draw_screen(ed);
+		save_view(ed, v);
+		v->version = ed->version;
+	}
+	load_view(ed, &ed->views[ed->curview]);
+	if (all)
+		draw_separators(ed);
+}
+
+void split_view(struct editor *ed, int vertical) {
+	// Split the current view in two, showing the same part of the text.
+	// The cursor stays in the upper or left one.
+	struct view *v;
+	int size;
+
+	if (ed->nviews == MAXVIEWS || (vertical ? ed->width : ed->height) < 3) {
+		outch('\007');
+		return;
+	}
+	v = &ed->views[ed->nviews++];
+	save_view(ed, v);
+	v->anchor = -1;
+	if (vertical) {
+		size = (ed->width - 1) / 2;
+		v->left += size + 1;
+		v->width -= size + 1;
+		ed->width = size;
 	} else {
-		for (i = 0; i < ed->env->lines; i++) {
-			int newpos = prev_line(ed, ed->linepos);
-			if (newpos < 0)
-				return;
+		size = (ed->height - 1) / 2;
+		v->top += size + 1;
+		v->height -= size + 1;
+		ed->height = size;
+	}
+	show_cursor(ed);
+}
 
-			ed->linepos = newpos;
-			ed->line--;
+void next_view(struct editor *ed) {
+	if (ed->nviews < 2)
+		return;
+	ed->anchor = -1;
+	save_view(ed, &ed->views[ed->curview]);
+	ed->curview = (ed->curview + 1) % ed->nviews;
+	load_view(ed, &ed->views[ed->curview]);
+	show_cursor(ed);
+}
 
-			if (ed->topline > 0) {
-				ed->toppos = prev_line(ed, ed->toppos);
-				ed->topline--;
+int covers_side(struct view *views, int n, int gone, int vertical, int after, int grow) {
+	// Check if the views on one side of a view together cover that side
+	// exactly. With grow they take over its area.
+	struct view *g = &views[gone], *v;
+	int gstart = vertical ? g->top : g->left;
+	int gsize = vertical ? g->height : g->width;
+	int gedge = vertical ? g->left : g->top;
+	int gdepth = vertical ? g->width : g->height;
+	int i, start, size, edge, depth, covered = 0;
+
+	for (i = 0; i < n; i++) {
+		if (i == gone)
+			continue;
+		v = &views[i];
+		start = vertical ? v->top : v->left;
+		size = vertical ? v->height : v->width;
+		edge = vertical ? v->left : v->top;
+		depth = vertical ? v->width : v->height;
+		if (after ? edge != gedge + gdepth + 1 : edge + depth + 1 != gedge)
+			continue;
+		if (start + size <= gstart || start >= gstart + gsize)
+			continue;
+		if (start < gstart || start + size > gstart + gsize)
+			return 0;
+		covered += size + 1;
+		if (grow) {
+			if (after)
+				edge = gedge;
+			depth += gdepth + 1;
+			if (vertical) {
+				v->left = edge;
+				v->width = depth;
+			} else {
+				v->top = edge;
+				v->height = depth;
 			}
 		}
 	}
-
-	ed->refresh = 1;
-	adjust(ed);
+	return covered == gsize + 1;
 }
 
-void pagedown(struct editor *ed, int select) {
-	int i;
+void close_view(struct editor *ed) {
+	// Remove the current view and give its area to the views next to it
+	int n = ed->nviews, cur = ed->curview;
+	int side, next;
 
-	update_selection(ed, select);
-	for (i = 0; i < ed->env->lines; i++) {
-		int newpos = next_line(ed, ed->linepos);
-		if (newpos < 0)
+	if (n < 2) {
+		outch('\007');
+		return;
+	}
+	save_view(ed, &ed->views[cur]);
+	for (side = 0; side < 4; side++) {
+		if (covers_side(ed->views, n, cur, side & 1, side >> 1, 0)) {
+			covers_side(ed->views, n, cur, side & 1, side >> 1, 1);
 			break;
-
-		ed->linepos = newpos;
-		ed->line++;
-
-		ed->toppos = next_line(ed, ed->toppos);
-		ed->topline++;
+		}
+	}
+	if (side == 4) {
+		outch('\007');
+		return;
 	}
 
-	ed->refresh = 1;
-	adjust(ed);
+	ed->views[cur] = ed->views[n - 1];
+	ed->nviews--;
+	next = cur < ed->nviews ? cur : 0;
+	ed->curview = next;
+	load_view(ed, &ed->views[next]);
+	show_cursor(ed);
 }
 
 //
-// Text editing
+// Editor Commands
 //
 
-void insert_char(struct editor *ed, unsigned char ch) {
-	erase_selection(ed);
-	insert(ed, ed->linepos + ed->col, &ch, 1);
-	ed->col++;
-	ed->lastcol = ed->col;
-	adjust(ed);
-	if (!ed->refresh)
-		ed->lineupdate = 1;
+int complete_editor(struct editor *ed, int wait) {
+	char filename[FILENAME_MAX];
+	struct env *env = ed->env;
+	int rc;
+
+	strcpy(filename, ed->filename);
+	rc = wait ? await_load(ed) : sync_load(ed);
+	if (rc < 0 && errno == ENOENT)
+		rc = new_file(ed, filename);
+	if (rc < 0) {
+		display_message(ed, "Error %d opening %s (%s)", errno, filename,
+				strerror(errno));
+		sleep(5);
+		delete_editor(ed);
+		if (!env->current) {
+			ed = create_editor(env);
+			new_file(ed, "");
+		}
+		env->current->refresh = 1;
+		return -1;
+	}
+	if (wait)
+		ed->refresh = 1;
+	return 0;
 }
 
-void newline(struct editor *ed) {
-	int p;
-	unsigned char ch;
+void open_editor(struct editor *ed) {
+	int rc;
+	char *filename;
+	struct env *env = ed->env;
 
-	erase_selection(ed);
-	insert(ed, ed->linepos + ed->col, NEW_LINE, 1);
-	ed->col = ed->lastcol = 0;
-	ed->line++;
-	p = ed->linepos;
-	ed->linepos = next_line(ed, ed->linepos);
+	if (!prompt(ed, "Open file: ", 1)) {
+		ed->refresh = 1;
+		return;
+	}
+	filename = ed->env->linebuf;
 
-	// This causes whitespace to be copied over to new lines.
-	// Causes issues if pasting text in, so disabled for now.
-	/*
-	for (;;) {
-		ch = get(ed, p++);
-		if (ch == ' ' || ch == '\t') {
-			insert(ed, ed->linepos + ed->col, &ch, 1);
-			ed->col++;
-		} else {
-			break;
+	ed = find_editor(ed->env, filename);
+	if (ed && ed->load && complete_editor(ed, 1) < 0)
+		ed = NULL;
+	if (ed) {
+		env->current = ed;
+	} else {
+		ed = create_editor(env);
+		rc = load_file(ed, filename);
+		if (rc < 0) {
+			display_message(ed, "Error %d opening %s (%s)", errno, filename,
+					strerror(errno));
+			sleep(5);
+			delete_editor(ed);
+			ed = env->current;
 		}
 	}
-	*/
-
-	ed->lastcol = ed->col;
+	ed->refresh = 1;
+}
 
+void new_editor(struct editor *ed) {
+	ed = create_editor(ed->env);
+	new_file(ed, "");
 	ed->refresh = 1;
+}
 
-	if (ed->line >= ed->topline + ed->env->lines) {
-		ed->toppos = next_line(ed, ed->toppos);
-		ed->topline++;
+int visible(struct editor *ed, int pos) {
+	int linepos = ed->toppos;
+	int i;
+
+	if (pos < linepos)
+		return 0;
+	for (i = 0; i < ed->height; i++) {
+		int next = next_line(ed, linepos);
+		if (next < 0 || pos < next)
+			return 1;
+		linepos = next;
+	}
+	return 0;
+}
+
+void appended(struct editor *ed, int pos, int atend) {
+	int i;
+
+	if (text_length(ed) == pos)
+		return;
+	if (ed->follow && atend) {
+		moveto(ed, text_length(ed), 0);
+		ed->lastcol = ed->col;
+		ed->refresh = 1;
+	} else if (visible(ed, pos)) {
 		ed->refresh = 1;
 	}
+	for (i = 0; i < ed->nviews; i++)
+		ed->views[i].version = -1;
+}
 
-	adjust(ed);
+int read_pipe(struct editor *ed) {
+	// Read what is available from the pipe. Returns -1 if reading failed.
+	int pos = text_length(ed);
+	int atend = next_line(ed, ed->linepos) < 0;
+	int rc = append_file(ed, ed->pipefd);
+	int err = errno;
+
+	if (rc == 0 || err != EAGAIN) {
+		close(ed->pipefd);
+		ed->pipefd = -1;
+	}
+	appended(ed, pos, atend);
+	errno = err;
+	return rc < 0 && err != EAGAIN ? -1 : 0;
 }
 
-void backspace(struct editor *ed) {
-	if (erase_selection(ed))
-		return;
-	if (ed->linepos + ed->col == 0)
-		return;
-	if (ed->col == 0) {
-		int pos = ed->linepos;
-		erase_section(ed, --pos, 1);
-		if (get(ed, pos - 1) == '\r')
-			erase_section(ed, --pos, 1);
+int file_changed(struct editor *ed) {
+	struct stat statbuf;
 
-		ed->line--;
-		ed->linepos = line_start(ed, pos);
-		ed->col = pos - ed->linepos;
-		ed->refresh = 1;
+	if (ed->newfile || stat(ed->filename, &statbuf) < 0)
+		return 0;
+	return !same_file(&statbuf, &ed->filestat);
+}
 
+void replace_keep_view(struct editor *ed, int pos, int len,
+		unsigned char *buf, int bufsize) {
+	// Replace text that may be away from the cursor while keeping the
+	// cursor, selection and top of screen on the same text
+	int cur = ed->linepos + ed->col;
+	int delta = bufsize - len;
+	int lines = count_newlines(buf, bufsize) - count_lines(ed, pos, len);
+	int linepos = line_start(ed, pos);
+	int line;
+
+	if (linepos >= ed->linepos)
+		line = ed->line + count_lines(ed, ed->linepos, linepos - ed->linepos);
+	else
+		line = ed->line - count_lines(ed, linepos, ed->linepos - linepos);
+
+	replace(ed, pos, len, buf, bufsize, 1);
+
+	if (ed->anchor > pos)
+		ed->anchor = ed->anchor >= pos + len ? ed->anchor + delta : pos;
+	if (ed->toppos > pos) {
+		if (ed->toppos >= pos + len) {
+			ed->toppos = line_start(ed, ed->toppos + delta);
+			ed->topline += lines;
+		} else {
+			ed->toppos = linepos;
+			ed->topline = line;
+		}
+	}
+	if (cur > pos) {
+		ed->linepos = linepos;
+		ed->line = line;
+		ed->col = 0;
+		moveto(ed, cur >= pos + len ? cur + delta : pos, 0);
 		if (ed->line < ed->topline) {
 			ed->toppos = ed->linepos;
 			ed->topline = ed->line;
 		}
-	} else {
-		ed->col--;
-		erase_section(ed, ed->linepos + ed->col, 1);
-		ed->lineupdate = 1;
 	}
-
-	ed->lastcol = ed->col;
-	adjust(ed);
+	ed->refresh = 1;
 }
 
-void del(struct editor *ed) {
-	int pos, ch;
+int reload_file(struct editor *ed) {
+	struct stat statbuf;
+	unsigned char *buf;
+	off_t size;
+	int f, len, newlen, head, tail, n;
 
-	if (erase_selection(ed))
-		return;
-	pos = ed->linepos + ed->col;
-	ch = get(ed, pos);
-	if (ch < 0)
-		return;
+	f = open(ed->filename, O_RDONLY | O_BINARY);
+	if (f < 0)
+		return -1;
+	if (fstat(f, &statbuf) < 0)
+		goto err;
+	size = statbuf.st_size;
+	if (size >= INT_MAX) {
+		errno = EFBIG;
+		goto err;
+	}
+	len = text_length(ed);
+	newlen = size;
+
+	if (!ed->dirty && newlen > len && len == ed->filestat.st_size) {
+		// If the end of the old contents is still in place assume the
+		// file was only appended to and just read the new bytes
+		unsigned char oldtail[4096], newtail[4096];
+		int taillen = len < 4096 ? len : 4096;
+
+		copy(ed, oldtail, len - taillen, taillen);
+		n = pread(f, newtail, taillen, len - taillen);
+		if (n == taillen && memcmp(oldtail, newtail, taillen) == 0) {
+			int atend = next_line(ed, ed->linepos) < 0;
+			lseek(f, len, SEEK_SET);
+			if (append_file(ed, f) < 0)
+				goto err;
+			statbuf.st_size = lseek(f, 0, SEEK_CUR);
+			appended(ed, len, atend);
+			goto done;
+		}
+	}
 
-	erase_section(ed, pos, 1);
-	if (ch == '\r') {
-		ch = get(ed, pos);
-		if (ch == '\n')
-			erase_section(ed, pos, 1);
+	buf = (unsigned char *) malloc(newlen + 1);
+	if (!buf)
+		goto err;
+	for (n = 0; n < newlen;) {
+		ssize_t rc = read(f, buf + n, newlen - n);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		n += rc;
 	}
+	newlen = n;
 
-	if (ch == '\n') {
-		ed->refresh = 1;
-	} else {
-		ed->lineupdate = 1;
+	// Only replace the part between the common prefix and suffix
+	head = common_ends(ed, buf, newlen, &tail);
+	if (head + tail < len || head + tail < newlen) {
+		replace_keep_view(ed, head, len - head - tail, buf + head,
+				newlen - head - tail);
 	}
+	free(buf);
+
+	done: close(f);
+	set_filestat(ed, &statbuf);
+	ed->changed = 0;
+	ed->dirty = 0;
+	ed->saveundo = ed->undo;
+	ed->savelost = 0;
+	reset_spans(ed);
+	close_journal(ed, 1);
+	return 0;
+
+	err: close(f);
+	return -1;
 }
 
-void undo(struct editor *ed) {
-	if (!ed->undo)
+void check_file(struct editor *ed) {
+	if (!file_changed(ed))
 		return;
-	moveto(ed, ed->undo->pos, 0);
-	replace(ed, ed->undo->pos, ed->undo->inserted, ed->undo->undobuf,
-			ed->undo->erased, 0);
-	ed->undo = ed->undo->prev;
-	if (!ed->undo)
-		ed->dirty = 0;
-	ed->refresh = 1;
+	if (ed->dirty || reload_file(ed) < 0)
+		ed->changed = 1;
 }
 
-void redo(struct editor *ed) {
-	if (ed->undo) {
-		if (!ed->undo->next)
-			return;
-		ed->undo = ed->undo->next;
-	} else {
-		if (!ed->undohead)
-			return;
-		ed->undo = ed->undohead;
+void follow_file(struct editor *ed) {
+	struct stat statbuf;
+	off_t oldsize;
+	int f, pos, atend, err;
+
+	f = open(ed->filename, O_RDONLY | O_BINARY);
+	if (f < 0)
+		return;
+	if (fstat(f, &statbuf) < 0) {
+		close(f);
+		return;
+	}
+	atend = next_line(ed, ed->linepos) < 0;
+
+	if (statbuf.st_dev != ed->filestat.st_dev || statbuf.st_ino != ed->filestat.st_ino
+			|| statbuf.st_size < ed->filestat.st_size) {
+		// The file was truncated or replaced, as when a log is rotated.
+		// Read it again from the start.
+		close(f);
+		if (statbuf.st_ino != ed->filestat.st_ino && ed->watch >= 0) {
+			inotify_rm_watch(ed->env->notifyfd, ed->watch);
+			ed->watch = -1;
+			watch_file(ed);
+		}
+		if (ed->dirty || reload_file(ed) < 0) {
+			ed->nspans = -1;
+			ed->changed = 1;
+		} else if (atend) {
+			moveto(ed, text_length(ed), 0);
+			ed->lastcol = ed->col;
+		}
+		ed->refresh = 1;
+		return;
 	}
 
-	replace(ed, ed->undo->pos, ed->undo->erased, ed->undo->redobuf,
-			ed->undo->inserted, 0);
-	moveto(ed, ed->undo->pos, 0);
-	ed->dirty = 1;
-	ed->refresh = 1;
+	if (statbuf.st_size > ed->filestat.st_size) {
+		// Only read the bytes appended since last time
+		pos = text_length(ed);
+		lseek(f, ed->filestat.st_size, SEEK_SET);
+		err = append_file(ed, f) < 0 ? errno : 0;
+		statbuf.st_size = lseek(f, 0, SEEK_CUR);
+		append_span(ed, text_length(ed) - pos, ed->filestat.st_size);
+		oldsize = ed->filestat.st_size;
+		set_filestat(ed, &statbuf);
+		journal_appended(ed, pos, oldsize);
+		appended(ed, pos, atend);
+		if (err) {
+			// Keep what was read and stop following
+			display_message(ed, "Error %d reading %s (%s)", err, ed->filename,
+					strerror(err));
+			sleep(5);
+			ed->follow = 0;
+			ed->refresh = 1;
+		}
+	}
+	close(f);
 }
 
-//
-// Clipboard
-//
+void recover_editor(struct editor *ed) {
+	char name[FILENAME_MAX];
+	struct journal header, expect;
+	struct record rec;
+	struct stat statbuf;
+	unsigned char *buf, *p, *end;
+	int f, pos = -1;
 
-void copy_selection(struct editor *ed) {
-	int selstart, selend;
+	ed->recover = 0;
+	if (sidecar_name(ed, name, "journal") < 0)
+		return;
+	f = open(name, O_RDONLY | O_CLOEXEC);
+	if (f < 0)
+		return;
+	if (flock(f, LOCK_EX | LOCK_NB) < 0) {
+		// Another editor is still journaling this file
+		close(f);
+		ed->journalfd = JOURNAL_OFF;
+		return;
+	}
+	buf = NULL;
+	if (fstat(f, &statbuf) < 0 || statbuf.st_size < sizeof(header)
+			|| !(buf = malloc(statbuf.st_size))
+			|| read(f, buf, statbuf.st_size) != statbuf.st_size) {
+		free(buf);
+		close(f);
+		return;
+	}
+	close(f);
 
-	if (!get_selection(ed, &selstart, &selend))
+	memcpy(&header, buf, sizeof(header));
+	journal_header(ed, &expect);
+	if (memcmp(&header, &expect, sizeof(header)) != 0) {
+		display_message(ed, "%s changed since unsaved changes were journaled. Discard them (y/n)? ",
+				ed->filename);
+		if (ask())
+			unlink(name);
+		else
+			ed->journalfd = JOURNAL_OFF;
+		free(buf);
+		ed->refresh = 1;
+		return;
+	}
+
+	display_message(ed, "Recover unsaved changes to %s (y/n)? ", ed->filename);
+	if (!ask()) {
+		unlink(name);
+		free(buf);
+		ed->refresh = 1;
 		return;
-	ed->env->clipsize = selend - selstart;
-	ed->env->clipboard = realloc(ed->env->clipboard,
-			ed->env->clipsize);
-	copy(ed, ed->env->clipboard, selstart, ed->env->clipsize);
-}
+	}
 
-void cut_selection(struct editor *ed) {
-	copy_selection(ed);
-	erase_selection(ed);
-}
+	// Replay the changes, stopping at a record cut short by the crash
+	p = buf + sizeof(header);
+	end = buf + statbuf.st_size;
+	while (end - p >= sizeof(rec)) {
+		memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+		if (rec.pos < 0 || rec.erased < 0 || rec.inserted < 0 || rec.inserted > end - p
+				|| rec.pos > text_length(ed) || rec.erased > text_length(ed) - rec.pos)
+			break;
+		replace(ed, rec.pos, rec.erased, p, rec.inserted, 1);
+		pos = rec.pos + rec.inserted;
+		p += rec.inserted;
+	}
+	free(buf);
 
-void paste_selection(struct editor *ed) {
-	erase_selection(ed);
-	insert(ed, ed->linepos + ed->col, ed->env->clipboard, ed->env->clipsize);
-	moveto(ed, ed->linepos + ed->col + ed->env->clipsize, 0);
+	if (pos >= 0)
+		moveto(ed, pos, 1);
 	ed->refresh = 1;
 }
 
-//
-// Editor Commands
-//
-
-void open_editor(struct editor *ed) {
-	int rc;
-	char *filename;
-	struct env *env = ed->env;
+void save_failed(struct editor *ed) {
+	display_message(ed, "Error %d saving %s (%s)", errno, ed->filename,
+			strerror(errno));
+	sleep(5);
+	ed->refresh = 1;
+}
 
-	if (!prompt(ed, "Open file: ")) {
-		ed->refresh = 1;
+void reload_editor(struct editor *ed) {
+	if (ed->newfile || !strcmp(ed->filename, "<stdin>")) {
+		outch('\007');
 		return;
 	}
-	filename = ed->env->linebuf;
+	if (ed->savepid && wait_save(ed) < 0)
+		save_failed(ed);
+	if (ed->dirty) {
+		display_message(ed, "Reload %s and discard changes (y/n)? ",
+				ed->filename);
+		if (!ask()) {
+			ed->refresh = 1;
+			return;
+		}
+	}
+	if (reload_file(ed) < 0) {
+		display_message(ed, "Error %d reloading %s (%s)", errno,
+				ed->filename, strerror(errno));
+		sleep(5);
+	}
+	ed->refresh = 1;
+}
 
-	ed = find_editor(ed->env, filename);
-	if (ed) {
-		env->current = ed;
+void toggle_follow(struct editor *ed) {
+	if (ed->follow) {
+		ed->follow = 0;
 	} else {
-		ed = create_editor(env);
-		rc = load_file(ed, filename);
-		if (rc < 0) {
-			display_message(ed, "Error %d opening %s (%s)", errno, filename,
-					strerror(errno));
-			sleep(5);
-			delete_editor(ed);
-			ed = env->current;
+		if (ed->pipefd < 0) {
+			if (ed->newfile || watch_file(ed) < 0) {
+				outch('\007');
+				return;
+			}
+			follow_file(ed);
 		}
+		ed->follow = 1;
+		ed->anchor = -1;
+		moveto(ed, text_length(ed), 0);
+		ed->lastcol = ed->col;
 	}
 	ed->refresh = 1;
 }
 
-void new_editor(struct editor *ed) {
-	ed = create_editor(ed->env);
-	new_file(ed, "");
+void toggle_wrap(struct editor *ed) {
+	ed->wrap = !ed->wrap;
+	ed->margin = ed->toprow = 0;
+	ed->lastcol = ed->col;
+	adjust(ed);
 	ed->refresh = 1;
 }
 
-void read_from_stdin(struct editor *ed) {
-	char buffer[512];
-	int n, pos;
+int read_from_stdin(struct editor *ed) {
+	struct stat statbuf;
+	int size = MINEXTEND;
+	int rc;
 
-	pos = 0;
-	while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
-		insert(ed, pos, buffer, n);
-		pos += n;
-	}
 	strcpy(ed->filename, "<stdin>");
+	ed->anchor = -1;
+	if (fstat(fileno(stdin), &statbuf) < 0)
+		return -1;
+	if (S_ISREG(statbuf.st_mode) && statbuf.st_size < INT_MAX - MINEXTEND)
+		size += statbuf.st_size;
+#ifdef F_SETPIPE_SZ
+	fcntl(fileno(stdin), F_SETPIPE_SZ, READCHUNK);
+#endif
+
+	ed->start = (unsigned char *) malloc(size);
+	if (!ed->start)
+		return -1;
+	ed->gap = ed->start;
+	ed->rest = ed->end = ed->start + size;
+	if (S_ISREG(statbuf.st_mode)) {
+		rc = append_file(ed, fileno(stdin));
+	} else {
+		// Keep reading the pipe from the event loop, so the editor
+		// comes up right away and can follow unbounded output
+		ed->pipefd = fcntl(fileno(stdin), F_DUPFD_CLOEXEC, 0);
+		if (ed->pipefd < 0)
+			return -1;
+		fcntl(ed->pipefd, F_SETFL, O_NONBLOCK);
+		rc = read_pipe(ed);
+	}
 	ed->dirty = 0;
+	return rc;
 }
 
 void save_editor(struct editor *ed) {
-	int rc;
-
+	if (ed->savepid && wait_save(ed) < 0)
+		save_failed(ed);
 	if (!ed->dirty && !ed->newfile)
 		return;
 
 	if (ed->newfile) {
-		if (!prompt(ed, "Save as: ")) {
+		if (!prompt(ed, "Save as: ", 1)) {
 			ed->refresh = 1;
 			return;
 		}
@@ -1379,21 +5873,27 @@ void save_editor(struct editor *ed) {
 		}
 		strcpy(ed->filename, ed->env->linebuf);
 		ed->newfile = 0;
+		register_editor(ed);
+		set_syntax(ed, ed->start, ed->gap - ed->start);
+	} else if (ed->changed || file_changed(ed)) {
+		display_message(ed, "%s changed on disk. Overwrite (y/n)? ",
+				ed->filename);
+		if (!ask()) {
+			ed->refresh = 1;
+			return;
+		}
 	}
 
-	rc = save_file(ed);
-	if (rc < 0) {
-		display_message(ed, "Error %d saving document (%s)", errno,
-				strerror(errno));
-		sleep(5);
-	}
-
+	if (save_file(ed) < 0)
+		save_failed(ed);
 	ed->refresh = 1;
 }
 
 void close_editor(struct editor *ed) {
 	struct env *env = ed->env;
 
+	if (ed->savepid && wait_save(ed) < 0)
+		save_failed(ed);
 	if (ed->dirty) {
 		display_message(ed, "Close %s without saving changes (y/n)? ",
 				ed->filename);
@@ -1403,6 +5903,7 @@ void close_editor(struct editor *ed) {
 		}
 	}
 
+	save_history(ed);
 	delete_editor(ed);
 
 	ed = env->current;
@@ -1413,32 +5914,208 @@ void close_editor(struct editor *ed) {
 	ed->refresh = 1;
 }
 
+int run_filter(struct editor *ed, char *cmd, int pos, int len,
+		unsigned char **output, int *status) {
+	int in[2], out[2];
+	struct iovec iov[2];
+	struct pollfd fds[2];
+	unsigned char *buf = NULL, *newbuf;
+	int bufsize = 0, newsize, n = 0, first = 0, niov = 0, splicing = 1;
+	int err = 0;
+	void (*sigpipe)(int);
+	pid_t pid, waited;
+
+	if (pipe2(in, O_CLOEXEC) < 0)
+		return -1;
+	if (pipe2(out, O_CLOEXEC) < 0) {
+		close(in[0]);
+		close(in[1]);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+		_exit(127);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	fcntl(out[0], F_SETFL, O_NONBLOCK);
+	sigpipe = signal(SIGPIPE, SIG_IGN);
+
+	// Input is fed directly from the two segments of the gap buffer.
+	// The buffer is not modified until the command has finished, so
+	// the pages handed to the pipe by vmsplice stay valid.
+	if (len > 0 && ed->start + pos < ed->gap) {
+		iov[niov].iov_base = ed->start + pos;
+		iov[niov].iov_len = ed->gap - (ed->start + pos);
+		if (iov[niov].iov_len > len)
+			iov[niov].iov_len = len;
+		len -= iov[niov].iov_len;
+		pos += iov[niov].iov_len;
+		niov++;
+	}
+	if (len > 0) {
+		iov[niov].iov_base = text_ptr(ed, pos);
+		iov[niov].iov_len = len;
+		niov++;
+	}
+	if (niov == 0) {
+		close(in[1]);
+		in[1] = -1;
+	}
+
+	while (out[0] >= 0) {
+		fds[0].fd = out[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = in[1];
+		fds[1].events = POLLOUT;
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (in[1] >= 0 && fds[1].revents) {
+			ssize_t rc = -1;
+			if (splicing) {
+				rc = vmsplice(in[1], iov + first, niov - first,
+						SPLICE_F_NONBLOCK);
+				if (rc < 0 && (errno == EINVAL || errno == ENOSYS))
+					splicing = 0;
+			}
+			if (!splicing)
+				rc = writev(in[1], iov + first, niov - first);
+
+			if (rc < 0 && errno != EAGAIN && errno != EINTR) {
+				// Command stopped reading its input
+				first = niov;
+			} else if (rc > 0) {
+				while (first < niov && rc >= iov[first].iov_len)
+					rc -= iov[first++].iov_len;
+				if (first < niov) {
+					iov[first].iov_base = (char *) iov[first].iov_base + rc;
+					iov[first].iov_len -= rc;
+				}
+			}
+			if (first == niov) {
+				close(in[1]);
+				in[1] = -1;
+			}
+		}
+
+		if (fds[0].revents) {
+			ssize_t rc;
+			if (bufsize - n < 4096) {
+				// Give up on output that does not fit in memory or an int,
+				// the command gets SIGPIPE when it writes more
+				newsize = bufsize > INT_MAX / 2 ? INT_MAX : bufsize ? bufsize * 2 : 65536;
+				newbuf = newsize > bufsize ? realloc(buf, newsize) : NULL;
+				if (!newbuf) {
+					err = newsize > bufsize ? ENOMEM : EFBIG;
+					close(out[0]);
+					out[0] = -1;
+					continue;
+				}
+				buf = newbuf;
+				bufsize = newsize;
+			}
+			rc = read(out[0], buf + n, bufsize - n);
+			if (rc > 0) {
+				n += rc;
+			} else if (rc == 0 || (errno != EAGAIN && errno != EINTR)) {
+				close(out[0]);
+				out[0] = -1;
+			}
+		}
+	}
+
+	if (out[0] >= 0)
+		close(out[0]);
+	if (in[1] >= 0)
+		close(in[1]);
+	while ((waited = waitpid(pid, status, 0)) < 0 && errno == EINTR)
+		;
+	if (waited < 0)
+		*status = -1;
+	signal(SIGPIPE, sigpipe);
+
+	if (err) {
+		free(buf);
+		errno = err;
+		return -1;
+	}
+	*output = buf;
+	return n;
+}
+
 void pipe_command(struct editor *ed) {
-	FILE *f;
-	char buffer[512];
-	int n;
-	int pos;
+	unsigned char *output;
+	int n, status, pos;
 
-	if (!prompt(ed, "Command: ")) {
+	if (!prompt(ed, "Command: ", 1)) {
 		ed->refresh = 1;
 		return;
 	}
 
-	f = popen(ed->env->linebuf, "r");
-	if (!f) {
+	n = run_filter(ed, ed->env->linebuf, 0, 0, &output, &status);
+	if (n < 0) {
 		display_message(ed, "Error %d running command (%s)", errno,
 				strerror(errno));
 		sleep(5);
 	} else {
 		erase_selection(ed);
 		pos = ed->linepos + ed->col;
-		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-			insert(ed, pos, buffer, n);
-			pos += n;
-		}
-		moveto(ed, pos, 0);
-		pclose(f);
+		if (n > 0)
+			insert(ed, pos, output, n);
+		moveto(ed, pos + n, 0);
+		free(output);
+	}
+	ed->refresh = 1;
+}
+
+void filter_command(struct editor *ed) {
+	unsigned char *output = NULL;
+	int selstart, selend, n, status;
+
+	if (!get_selection(ed, &selstart, &selend)) {
+		outch('\007');
+		return;
+	}
+	if (!prompt(ed, "Filter: ", 0)) {
+		ed->refresh = 1;
+		return;
+	}
+
+	n = run_filter(ed, ed->env->linebuf, selstart, selend - selstart, &output,
+			&status);
+	if (n < 0) {
+		display_message(ed, "Error %d running command (%s)", errno,
+				strerror(errno));
+		sleep(5);
+	} else if (n == 0 && status != 0) {
+		// Keep the selection if the command failed without output
+		display_message(ed, "Command failed with status %d",
+				WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+		sleep(5);
+	} else {
+		moveto(ed, selstart, 0);
+		replace(ed, selstart, selend - selstart, output, n, 1);
+		ed->anchor = selstart;
+		moveto(ed, selstart + n, 0);
 	}
+	free(output);
 	ed->refresh = 1;
 }
 
@@ -1446,7 +6123,7 @@ void find_text(struct editor *ed, int next) {
 	int slen;
 
 	if (!next) {
-		if (!prompt(ed, "Find: ")) {
+		if (!prompt(ed, "Find: ", 1)) {
 			ed->refresh = 1;
 			return;
 		}
@@ -1465,6 +6142,7 @@ void find_text(struct editor *ed, int next) {
 		match = strstr(ed->start + ed->linepos + ed->col, ed->env->search);
 		if (match != NULL) {
 			int pos = match - ed->start;
+			push_jump(ed);
 			ed->anchor = pos;
 			moveto(ed, pos + slen, 1);
 		} else {
@@ -1478,7 +6156,8 @@ void goto_line(struct editor *ed) {
 	int lineno, l, pos;
 
 	ed->anchor = -1;
-	if (prompt(ed, "Goto line: ")) {
+	if (prompt(ed, "Goto line: ", 1)) {
+		wait_load(ed, 1);
 		lineno = atoi(ed->env->linebuf);
 		if (lineno > 0) {
 			pos = 0;
@@ -1492,6 +6171,7 @@ void goto_line(struct editor *ed) {
 		}
 
 		if (pos >= 0) {
+			push_jump(ed);
 			moveto(ed, pos, 1);
 		} else {
 			outch('\007');
@@ -1500,6 +6180,95 @@ void goto_line(struct editor *ed) {
 	ed->refresh = 1;
 }
 
+void jump_to(struct editor *ed, int pos) {
+	ed->anchor = -1;
+	moveto(ed, pos, 1);
+	ed->lastcol = ed->col;
+	ed->refresh = 1;
+}
+
+void jump_back(struct editor *ed) {
+	// The first time back the current position is added, so going
+	// forward again returns to it
+	if (ed->jump == ed->njumps) {
+		push_jump(ed);
+		ed->jump--;
+	}
+	if (ed->jump <= 0) {
+		outch('\007');
+		return;
+	}
+	jump_to(ed, mark_pos(ed->jumps[--ed->jump]));
+}
+
+void jump_forward(struct editor *ed) {
+	if (ed->jump + 1 >= ed->njumps) {
+		outch('\007');
+		return;
+	}
+	jump_to(ed, mark_pos(ed->jumps[++ed->jump]));
+}
+
+void goto_last_edit(struct editor *ed) {
+	if (!ed->lastedit) {
+		outch('\007');
+		return;
+	}
+	push_jump(ed);
+	jump_to(ed, mark_pos(ed->lastedit));
+}
+
+struct bookmark *find_bookmark(struct editor *ed, char *name) {
+	struct bookmark *b;
+
+	for (b = ed->bookmarks; b; b = b->next) {
+		if (strcmp(b->name, name) == 0)
+			return b;
+	}
+	return NULL;
+}
+
+void set_bookmark(struct editor *ed) {
+	struct bookmark *b;
+	int pos = ed->linepos + ed->col;
+
+	if (prompt(ed, "Set bookmark: ", 0)) {
+		b = find_bookmark(ed, ed->env->linebuf);
+		if (b) {
+			set_mark(ed, b->mark, pos);
+		} else {
+			b = (struct bookmark *) calloc(1, sizeof(struct bookmark));
+			if (b)
+				b->mark = add_mark(ed, pos);
+			if (b && b->mark && (b->name = strdup(ed->env->linebuf))) {
+				b->next = ed->bookmarks;
+				ed->bookmarks = b;
+			} else {
+				if (b)
+					remove_mark(ed, b->mark);
+				free(b);
+				outch('\007');
+			}
+		}
+	}
+	ed->refresh = 1;
+}
+
+void goto_bookmark(struct editor *ed) {
+	struct bookmark *b;
+
+	if (prompt(ed, "Goto bookmark: ", 0)) {
+		b = find_bookmark(ed, ed->env->linebuf);
+		if (b) {
+			push_jump(ed);
+			jump_to(ed, mark_pos(b->mark));
+		} else {
+			outch('\007');
+		}
+	}
+	ed->refresh = 1;
+}
+
 struct editor *next_file(struct editor *ed) {
 	ed = ed->env->current = ed->next;
 	ed->refresh = 1;
@@ -1552,6 +6321,8 @@ void jump_to_editor(struct editor *ed) {
 		return;
 
 	ed = find_editor(env, filename);
+	if (ed && ed->load && complete_editor(ed, 1) < 0)
+		ed = NULL;
 	if (ed) {
 		env->current = ed;
 	} else {
@@ -1565,6 +6336,7 @@ void jump_to_editor(struct editor *ed) {
 
 	if (lineno > 0) {
 		int pos = 0;
+		wait_load(ed, 1);
 		while (--lineno > 0) {
 			pos = next_line(ed, pos);
 			if (pos < 0)
@@ -1579,7 +6351,11 @@ void jump_to_editor(struct editor *ed) {
 
 void redraw_screen(struct editor *ed) {
 	get_console_size(ed->env);
+	fit_views(ed);
+	if (ed->wrap)
+		scroll_wrap(ed);
 	draw_screen(ed);
+	draw_other_views(ed, 1);
 	draw_full_statusline(ed);
 	position_cursor(ed);
 	fflush(stdout);
@@ -1590,6 +6366,8 @@ int quit(struct env *env) {
 	struct editor *start = ed;
 
 	do {
+		if (ed->savepid && wait_save(ed) < 0)
+			save_failed(ed);
 		if (ed->dirty) {
 			display_message(ed, "Close %s without saving changes (y/n)? ",
 					ed->filename);
@@ -1627,29 +6405,242 @@ void help(struct editor *ed) {
 	outstr("<delete>     Delete current character     Ctrl+G  Find next\r\n");
 	outstr("Shift+<tab>  Next editor                  Ctrl+L  Goto line\r\n");
 	outstr("Ctrl+<tab>   Previous editor              F1      Help\r\n");
+	outstr("Alt+,        Earlier in undo history      F3      Navigate to file\r\n");
+	outstr("Alt+.        Later in undo history        F5      Redraw screen\r\n");
+	outstr("Alt+U        Revert to saved              Ctrl+E  Filter selection\r\n");
 	outstr(
-			"                                          F3      Navigate to file\r\n");
+			"(*) Extends selection with Shift          Alt+F   Follow file\r\n");
 	outstr(
-			"(*) Extends selection if combined         F5      Redraw screen\r\n");
-	outstr("    with Shift\r\n");
+			"Alt+W        Wrap long lines              Alt+R   Reload file\r\n");
+	outstr("Alt+2        Split view below             Alt+O   Next view\r\n");
+	outstr("Alt+3        Split view right             Alt+0   Close view\r\n");
+	outstr("Alt+M        Set bookmark                 Alt+B   Jump back\r\n");
+	outstr("Alt+J        Goto bookmark                Alt+N   Jump forward\r\n");
+	outstr("Alt+E        Goto last edit\r\n");
 	outstr("\r\nPress any key to continue...");
 	fflush(stdout);
 
 	getkey();
 	draw_screen(ed);
+	draw_other_views(ed, 1);
 	draw_full_statusline(ed);
 }
 
+//
+// Event loop
+//
+
+void handle_notify(struct env *env) {
+	union {
+		struct inotify_event event;
+		char buf[4096];
+	} u;
+	ssize_t n;
+	int wd;
+
+	while ((n = read(env->notifyfd, u.buf, sizeof(u.buf))) > 0) {
+		char *p = u.buf;
+		while (p < u.buf + n) {
+			struct inotify_event *event = (struct inotify_event *) p;
+			struct editor *ed = env->current;
+			do {
+				if (ed->watch == event->wd) {
+					if (event->mask & IN_IGNORED) {
+						// File was deleted or replaced, watch the new one
+						ed->watch = -1;
+						watch_file(ed);
+					} else if (event->mask & IN_MOVE_SELF) {
+						// File was renamed, watch the one now under its
+						// name if there is one yet
+						wd = ed->watch;
+						ed->watch = -1;
+						if (watch_file(ed) < 0)
+							ed->watch = wd;
+						else if (ed->watch != wd)
+							inotify_rm_watch(env->notifyfd, wd);
+					}
+					if (ed->follow)
+						follow_file(ed);
+					else if (event->mask != IN_MODIFY)
+						check_file(ed);
+				}
+				ed = ed->next;
+			} while (ed != env->current);
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
+void handle_loads(struct env *env) {
+	char buf[64];
+	struct load **p;
+	struct editor *ed;
+	int i, n;
+
+	while (read(env->wakefd[0], buf, sizeof(buf)) > 0)
+		;
+
+	// Release loads of editors closed while loading
+	pthread_mutex_lock(&env->lock);
+	for (p = &env->loads; *p;) {
+		struct load *load = *p;
+		if (load->state == LOAD_DONE && !load->ed) {
+			*p = load->next;
+			free(load->buf);
+			free(load);
+		} else {
+			p = &load->next;
+		}
+	}
+	pthread_mutex_unlock(&env->lock);
+
+	n = 0;
+	ed = env->current;
+	do {
+		n++;
+		ed = ed->next;
+	} while (ed != env->current);
+
+	for (i = 0; i < n; i++) {
+		struct editor *next = ed->next;
+		if (ed->load) {
+			int pos = text_length(ed);
+			int atend = next_line(ed, ed->linepos) < 0;
+			if (complete_editor(ed, 0) == 0)
+				appended(ed, pos, atend);
+		}
+		ed = next;
+	}
+}
+
+void handle_lex(struct env *env) {
+	// Take the states from lines the background lexer is done with. The
+	// ones past a line changed since the lines were copied are dropped.
+	struct lexjob *done = NULL, *job, **p;
+	struct editor *ed;
+	int i;
+
+	pthread_mutex_lock(&env->lock);
+	for (p = &env->lexjobs; *p;) {
+		job = *p;
+		if (job->done) {
+			*p = job->next;
+			job->next = done;
+			done = job;
+		} else {
+			p = &job->next;
+		}
+	}
+	pthread_mutex_unlock(&env->lock);
+
+	while (done) {
+		job = done;
+		done = job->next;
+		ed = job->ed;
+		if (ed) {
+			ed->lexjob = NULL;
+			for (i = 0; i < job->valid; i++)
+				store_state(ed, job->line + 1 + i, job->states[i]);
+			if (job->valid == job->lines
+					&& ed->goodstates == job->line + 1 + job->lines) {
+				ed->lexline = ed->goodstates - 1;
+				ed->lexpos = job->endpos;
+			} else if (ed->syncline == ed->goodstates - 1) {
+				ed->lexline = ed->syncline;
+				ed->lexpos = ed->syncpos;
+			}
+			if (job->version != ed->version || ed->goodstates > job->target
+					|| queue_lex(ed, job->target, job->targetpos) < 0)
+				ed->refresh = 1;
+		}
+		free(job->text);
+		free(job->states);
+		free(job);
+	}
+}
+
+void handle_save(struct editor *ed) {
+	if (!read_save(ed) && finish_save(ed) < 0)
+		save_failed(ed);
+}
+
+int wait_event(struct env *env) {
+	struct editor *ed;
+	int count = 3;
+	int i, n;
+
+	ed = env->current;
+	do {
+		if (ed->pipefd >= 0)
+			count++;
+		if (ed->savefd >= 0)
+			count++;
+		ed = ed->next;
+	} while (ed != env->current);
+
+	struct pollfd fds[count];
+	fds[0].fd = fileno(stdin);
+	fds[1].fd = env->notifyfd ? env->notifyfd : -1;
+	fds[2].fd = env->threads ? env->wakefd[0] : -1;
+	n = 3;
+	do {
+		if (ed->pipefd >= 0)
+			fds[n++].fd = ed->pipefd;
+		if (ed->savefd >= 0)
+			fds[n++].fd = ed->savefd;
+		ed = ed->next;
+	} while (ed != env->current);
+	for (i = 0; i < n; i++)
+		fds[i].events = POLLIN;
+
+	if (poll(fds, n, sync_journals(env)) <= 0)
+		return 0;
+	if (fds[0].revents)
+		return 1;
+
+	if (fds[1].revents)
+		handle_notify(env);
+	if (fds[2].revents) {
+		handle_loads(env);
+		handle_lex(env);
+	}
+	ed = env->current;
+	do {
+		struct editor *next = ed->next;
+		for (i = 3; i < n; i++) {
+			if (fds[i].fd == ed->pipefd && fds[i].revents)
+				read_pipe(ed);
+			if (fds[i].fd == ed->savefd && fds[i].revents)
+				handle_save(ed);
+		}
+		ed = next;
+	} while (ed != env->current);
+	return 0;
+}
+
 //
 // Editor
 //
 
 void edit(struct editor *ed) {
+	struct env *env = ed->env;
 	int done = 0;
+	int resized;
 	int key;
 
 	ed->refresh = 1;
 	while (!done) {
+		resized = env->resized;
+		if (resized) {
+			env->resized = 0;
+			get_console_size(env);
+			ed->refresh = 1;
+		}
+		if (ed->recover)
+			recover_editor(ed);
+		fit_views(ed);
+		if (ed->wrap)
+			scroll_wrap(ed);
 		if (ed->refresh) {
 			draw_screen(ed);
 			draw_full_statusline(ed);
@@ -1662,14 +6653,23 @@ void edit(struct editor *ed) {
 		} else {
 			draw_full_statusline(ed);
 		}
+		draw_other_views(ed, resized);
 
 		position_cursor(ed);
 		fflush(stdout);
+		if (!wait_event(env)) {
+			ed = env->current;
+			continue;
+		}
 		key = getkey();
+		if (ed->load && !ed->start) {
+			complete_editor(ed, 1);
+			ed = env->current;
+		}
 
-		if (key >= ' ' && key <= 0x7F) {
+		if (key >= ' ' && key < 0x100) {
 #ifndef LESS
-			insert_char(ed, (unsigned char) key);
+			insert_char(ed, key);
 #endif
 		} else {
 			switch (key) {
@@ -1678,14 +6678,14 @@ void edit(struct editor *ed) {
 				break;
 			case KEY_F3:
 				jump_to_editor(ed);
-				ed = ed->env->current;
+				ed = env->current;
 				break;
 			case KEY_F5:
 				redraw_screen(ed);
 				break;
 			case ctrl('u'):
 				jump_to_editor(ed);
-				ed = ed->env->current;
+				ed = env->current;
 				break;
 			case ctrl('y'):
 				help(ed);
@@ -1797,6 +6797,42 @@ void edit(struct editor *ed) {
 			case ctrl('q'):
 				done = 1;
 				break;
+			case alt('f'):
+				toggle_follow(ed);
+				break;
+			case alt('w'):
+				toggle_wrap(ed);
+				break;
+			case alt('2'):
+				split_view(ed, 0);
+				break;
+			case alt('3'):
+				split_view(ed, 1);
+				break;
+			case alt('o'):
+				next_view(ed);
+				break;
+			case alt('0'):
+				close_view(ed);
+				break;
+			case alt('m'):
+				set_bookmark(ed);
+				break;
+			case alt('j'):
+				goto_bookmark(ed);
+				break;
+			case alt('b'):
+				jump_back(ed);
+				break;
+			case alt('n'):
+				jump_forward(ed);
+				break;
+			case alt('e'):
+				goto_last_edit(ed);
+				break;
+			case alt('r'):
+				reload_editor(ed);
+				break;
 #ifdef LESS
 				case KEY_ESC: done = 1; break;
 #else
@@ -1821,20 +6857,29 @@ void edit(struct editor *ed) {
 			case ctrl('r'):
 				redo(ed);
 				break;
+			case alt(','):
+				earlier(ed);
+				break;
+			case alt('.'):
+				later(ed);
+				break;
+			case alt('u'):
+				revert_undo(ed);
+				break;
 			case ctrl('v'):
 				paste_selection(ed);
 				break;
 			case ctrl('o'):
 				open_editor(ed);
-				ed = ed->env->current;
+				ed = env->current;
 				break;
 			case ctrl('n'):
 				new_editor(ed);
-				ed = ed->env->current;
+				ed = env->current;
 				break;
 			case ctrl('w'):
 				close_editor(ed);
-				ed = ed->env->current;
+				ed = env->current;
 				break;
 			case ctrl('s'):
 				save_editor(ed);
@@ -1842,6 +6887,9 @@ void edit(struct editor *ed) {
 			case ctrl('p'):
 				pipe_command(ed);
 				break;
+			case ctrl('e'):
+				filter_command(ed);
+				break;
 #endif
 			}
 		}
@@ -1853,7 +6901,12 @@ struct env env;
 
 // window resize handler
 void handle_winch() {
-	redraw_screen(env.current);
+	// Only flag the resize and wake up the event loop, which redraws
+	int err = errno;
+
+	env.resized = 1;
+	write(env.wakefd[1], "", 1);
+	errno = err;
 	signal(SIGWINCH, handle_winch);
 }
 
@@ -1875,11 +6928,20 @@ int main(int argc, char *argv[]) {
 	memset(&env, 0, sizeof(env));
 	for (i = 1; i < argc; i++) {
 		struct editor *ed = create_editor(&env);
-		rc = load_file(ed, argv[i]);
+		if (queue_load(ed, argv[i], i == argc - 1) < 0) {
+			perror(argv[i]);
+			return 0;
+		}
+	}
+	if (env.current) {
+		// Show the current editor as soon as the start of its file is
+		// in, the rest is filled in by the event loop
+		struct editor *ed = env.current;
+		rc = await_load(ed);
 		if (rc < 0 && errno == ENOENT)
-			rc = new_file(ed, argv[i]);
+			rc = new_file(ed, argv[argc - 1]);
 		if (rc < 0) {
-			perror(argv[i]);
+			perror(argv[argc - 1]);
 			return 0;
 		}
 	}
@@ -1887,13 +6949,15 @@ int main(int argc, char *argv[]) {
 		struct editor *ed = create_editor(&env);
 		if (isatty(fileno(stdin))) {
 			new_file(ed, "");
-		} else {
-			read_from_stdin(ed);
+		} else if (read_from_stdin(ed) < 0) {
+			perror("<stdin>");
+			return 0;
 		}
 	}
 
 	if (!isatty(fileno(stdin)))
 		freopen("/dev/tty", "r", stdin);
+	setvbuf(stdin, NULL, _IONBF, 0);
 
 	setvbuf(stdout, NULL, 0, 8192);
 
@@ -1910,6 +6974,7 @@ int main(int argc, char *argv[]) {
 	sigaddset(&blocked_sigmask, SIGTSTP);
 	sigaddset(&blocked_sigmask, SIGABRT);
 	sigprocmask(SIG_BLOCK, &blocked_sigmask, &orig_sigmask);
+	start_threads(&env);
 	signal(SIGWINCH, handle_winch);
 
 	for (;;) {
@@ -1925,8 +6990,11 @@ int main(int argc, char *argv[]) {
 
 	tcsetattr(0, TCSANOW, &orig_tio);
 
-	while (env.current)
+	while (env.current) {
+		save_history(env.current);
 		delete_editor(env.current);
+	}
+	stop_threads(&env);
 
 	if (env.clipboard)
 		free(env.clipboard);
@@ -1934,6 +7002,10 @@ int main(int argc, char *argv[]) {
 		free(env.search);
 	if (env.linebuf)
 		free(env.linebuf);
+	free(env.syntaxbuf);
+	free(env.attrs);
+	free(env.bypath);
+	free(env.byid);
 
 	setbuf(stdout, NULL);
 	sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);